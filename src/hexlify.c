@@ -14,24 +14,110 @@
  * limitations under the License.
  */
 
+#include "hexlify.h"
+#include "kms_alloc.h"
+
 #include <assert.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-char *
-hexlify (const uint8_t *buf, size_t len)
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+#define KMS_HEXLIFY_X86
+#include <immintrin.h>
+#endif
+
+/* "00" through "ff", two chars per byte value */
+static const char hex_pairs[513] =
+   "000102030405060708090a0b0c0d0e0f"
+   "101112131415161718191a1b1c1d1e1f"
+   "202122232425262728292a2b2c2d2e2f"
+   "303132333435363738393a3b3c3d3e3f"
+   "404142434445464748494a4b4c4d4e4f"
+   "505152535455565758595a5b5c5d5e5f"
+   "606162636465666768696a6b6c6d6e6f"
+   "707172737475767778797a7b7c7d7e7f"
+   "808182838485868788898a8b8c8d8e8f"
+   "909192939495969798999a9b9c9d9e9f"
+   "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+   "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+   "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+   "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+   "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+   "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* the value of a hex digit, or -1 */
+static const int8_t hex_values[256] = {
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+   -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#ifdef KMS_HEXLIFY_X86
+
+/* 16 bytes at a time: split into nibbles, look each up with pshufb, and
+ * interleave the high and low digits */
+static __attribute__ ((target ("ssse3"))) size_t
+hexlify_ssse3 (char *out, const uint8_t *buf, size_t len)
 {
-   char *hex_chars = malloc (len * 2 + 1);
-   char *p = hex_chars;
+   const __m128i digits = _mm_setr_epi8 ('0', '1', '2', '3', '4', '5', '6',
+                                         '7', '8', '9', 'a', 'b', 'c', 'd',
+                                         'e', 'f');
+   const __m128i low_mask = _mm_set1_epi8 (0xf);
+   __m128i v, hi, lo;
    size_t i;
 
-   for (i = 0; i < len; i++) {
-      p += sprintf (p, "%02x", buf[i]);
+   for (i = 0; i + 16 <= len; i += 16) {
+      v = _mm_loadu_si128 ((const __m128i *) (buf + i));
+      hi = _mm_shuffle_epi8 (digits,
+                             _mm_and_si128 (_mm_srli_epi16 (v, 4), low_mask));
+      lo = _mm_shuffle_epi8 (digits, _mm_and_si128 (v, low_mask));
+      _mm_storeu_si128 ((__m128i *) (out + 2 * i), _mm_unpacklo_epi8 (hi, lo));
+      _mm_storeu_si128 ((__m128i *) (out + 2 * i + 16),
+                        _mm_unpackhi_epi8 (hi, lo));
+   }
+
+   return i;
+}
+
+#endif
+
+void
+hexlify_into (char *out, const uint8_t *buf, size_t len)
+{
+   size_t i = 0;
+
+#ifdef KMS_HEXLIFY_X86
+   if (len >= 16 && __builtin_cpu_supports ("ssse3")) {
+      i = hexlify_ssse3 (out, buf, len);
    }
+#endif
 
-   *p = '\0';
+   for (; i < len; i++) {
+      memcpy (out + 2 * i, hex_pairs + 2 * buf[i], 2);
+   }
+}
+
+char *
+hexlify (const uint8_t *buf, size_t len)
+{
+   char *hex_chars = kms_malloc (len * 2 + 1);
+
+   hexlify_into (hex_chars, buf, len);
+   hex_chars[len * 2] = '\0';
 
    return hex_chars;
 }
@@ -39,17 +125,19 @@ hexlify (const uint8_t *buf, size_t len)
 uint8_t *
 unhexlify (const char *hex_chars, size_t *len)
 {
+   const uint8_t *in = (const uint8_t *) hex_chars;
    uint8_t *buf;
-   uint8_t *pos;
+   int hi, lo;
+   size_t i;
 
    *len = strlen (hex_chars) / 2;
-   buf = malloc (*len);
-   pos = buf;
+   buf = kms_malloc (*len);
 
-   while (*hex_chars) {
-      assert (1 == sscanf (hex_chars, "%2hhx", pos));
-      pos++;
-      hex_chars += 2;
+   for (i = 0; i < *len; i++) {
+      hi = hex_values[in[2 * i]];
+      lo = hex_values[in[2 * i + 1]];
+      assert (hi >= 0 && lo >= 0);
+      buf[i] = (uint8_t) ((unsigned) hi << 4 | (unsigned) lo);
    }
 
    return buf;
@@ -17,6 +17,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/* write 2 * len lowercase hex chars to "out", without a trailing nil */
+void
+hexlify_into (char *out, const uint8_t *buf, size_t len);
 char *
 hexlify (const uint8_t *buf, size_t len);
 uint8_t *
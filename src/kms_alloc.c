@@ -0,0 +1,118 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kms_alloc.h"
+#include "kms_message/kms_message.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *
+default_malloc (size_t size, void *ctx)
+{
+   (void) ctx;
+   return malloc (size);
+}
+
+static void *
+default_realloc (void *ptr, size_t size, void *ctx)
+{
+   (void) ctx;
+   return realloc (ptr, size);
+}
+
+static void
+default_free (void *ptr, void *ctx)
+{
+   (void) ctx;
+   free (ptr);
+}
+
+static kms_message_allocator_t allocator = {
+   default_malloc, default_realloc, default_free, NULL};
+
+void
+kms_message_set_allocator (const kms_message_allocator_t *a)
+{
+   if (a) {
+      allocator = *a;
+   } else {
+      allocator.malloc_fn = default_malloc;
+      allocator.realloc_fn = default_realloc;
+      allocator.free_fn = default_free;
+      allocator.ctx = NULL;
+   }
+}
+
+void *
+kms_malloc (size_t size)
+{
+   return allocator.malloc_fn (size, allocator.ctx);
+}
+
+void *
+kms_calloc (size_t nmemb, size_t size)
+{
+   void *p;
+
+   if (size && nmemb > SIZE_MAX / size) {
+      return NULL;
+   }
+
+   p = kms_malloc (nmemb * size);
+   if (p) {
+      memset (p, 0, nmemb * size);
+   }
+
+   return p;
+}
+
+void *
+kms_realloc (void *ptr, size_t size)
+{
+   return allocator.realloc_fn (ptr, size, allocator.ctx);
+}
+
+void
+kms_free (void *ptr)
+{
+   if (ptr) {
+      allocator.free_fn (ptr, allocator.ctx);
+   }
+}
+
+char *
+kms_strdup (const char *s)
+{
+   return kms_strndup (s, strlen (s));
+}
+
+char *
+kms_strndup (const char *s, size_t len)
+{
+   char *dst;
+
+   /* like strndup, stop early at a NUL */
+   len = strnlen (s, len);
+   dst = kms_malloc (len + 1);
+   if (dst) {
+      memcpy (dst, s, len);
+      dst[len] = '\0';
+   }
+
+   return dst;
+}
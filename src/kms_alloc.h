@@ -0,0 +1,40 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KMS_ALLOC_H
+#define KMS_ALLOC_H
+
+#include <stddef.h>
+
+/* All allocations in the library go through these, so the application can
+ * replace them with kms_message_set_allocator. Memory from one must not be
+ * freed with free (), nor memory from malloc () with kms_free. */
+
+void *
+kms_malloc (size_t size);
+/* returns NULL if nmemb * size overflows */
+void *
+kms_calloc (size_t nmemb, size_t size);
+void *
+kms_realloc (void *ptr, size_t size);
+void
+kms_free (void *ptr);
+char *
+kms_strdup (const char *s);
+char *
+kms_strndup (const char *s, size_t len);
+
+#endif /* KMS_ALLOC_H */
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kms_arena.h"
+#include "kms_alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define KMS_ARENA_BLOCK_SIZE 4096
+/* enough for any type */
+#define KMS_ARENA_ALIGN 16
+
+struct _kms_arena_block_t {
+   kms_arena_block_t *next;
+   size_t size; /* usable bytes */
+   size_t used;
+   size_t last; /* offset of the last allocation */
+};
+
+static size_t
+align_up (size_t size)
+{
+   return (size + KMS_ARENA_ALIGN - 1) & ~(size_t) (KMS_ARENA_ALIGN - 1);
+}
+
+static char *
+block_data (kms_arena_block_t *block)
+{
+   return (char *) block + align_up (sizeof (kms_arena_block_t));
+}
+
+kms_arena_t *
+kms_arena_new (void)
+{
+   return kms_calloc (1, sizeof (kms_arena_t));
+}
+
+static void
+free_blocks (kms_arena_block_t *block)
+{
+   kms_arena_block_t *next;
+
+   while (block) {
+      next = block->next;
+      kms_free (block);
+      block = next;
+   }
+}
+
+void
+kms_arena_destroy (kms_arena_t *arena)
+{
+   if (!arena) {
+      return;
+   }
+
+   free_blocks (arena->block);
+   free_blocks (arena->spare);
+   kms_free (arena);
+}
+
+void *
+kms_arena_alloc (kms_arena_t *arena, size_t size)
+{
+   kms_arena_block_t *block = arena->block;
+   kms_arena_block_t **spare;
+
+   size = align_up (size ? size : 1);
+
+   if (!block || block->size - block->used < size) {
+      /* reuse a rewound block if one is big enough */
+      for (spare = &arena->spare; *spare && (*spare)->size < size;
+           spare = &(*spare)->next) {
+      }
+
+      if (*spare) {
+         block = *spare;
+         *spare = block->next;
+      } else {
+         block = kms_malloc (align_up (sizeof (kms_arena_block_t)) +
+                         (size > KMS_ARENA_BLOCK_SIZE ? size
+                                                      : KMS_ARENA_BLOCK_SIZE));
+         if (!block) {
+            return NULL;
+         }
+
+         block->size =
+            size > KMS_ARENA_BLOCK_SIZE ? size : KMS_ARENA_BLOCK_SIZE;
+      }
+
+      block->used = 0;
+      block->next = arena->block;
+      arena->block = block;
+   }
+
+   block->last = block->used;
+   block->used += size;
+
+   return block_data (block) + block->last;
+}
+
+void *
+kms_arena_realloc (kms_arena_t *arena,
+                   void *ptr,
+                   size_t old_size,
+                   size_t size)
+{
+   kms_arena_block_t *block = arena->block;
+   void *p;
+
+   if (!ptr) {
+      return kms_arena_alloc (arena, size);
+   }
+
+   if (size <= old_size) {
+      return ptr;
+   }
+
+   if (block && (char *) ptr == block_data (block) + block->last &&
+       block->last + align_up (size) <= block->size) {
+      block->used = block->last + align_up (size);
+      return ptr;
+   }
+
+   p = kms_arena_alloc (arena, size);
+   if (p) {
+      memcpy (p, ptr, old_size);
+   }
+
+   return p;
+}
+
+kms_arena_mark_t
+kms_arena_mark (const kms_arena_t *arena)
+{
+   kms_arena_mark_t mark;
+
+   mark.block = arena ? arena->block : NULL;
+   mark.used = mark.block ? mark.block->used : 0;
+
+   return mark;
+}
+
+void
+kms_arena_rewind (kms_arena_t *arena, kms_arena_mark_t mark)
+{
+   kms_arena_block_t *block;
+
+   if (!arena) {
+      return;
+   }
+
+   /* blocks started since the mark are kept for reuse */
+   while (arena->block != mark.block) {
+      block = arena->block;
+      arena->block = block->next;
+      block->next = arena->spare;
+      arena->spare = block;
+   }
+
+   if (mark.block) {
+      mark.block->used = mark.used;
+      /* nothing after the mark may grow in place */
+      mark.block->last = mark.used;
+   }
+}
+
+static size_t
+count_blocks (const kms_arena_block_t *block)
+{
+   size_t n = 0;
+
+   for (; block; block = block->next) {
+      n++;
+   }
+
+   return n;
+}
+
+size_t
+kms_arena_block_count (const kms_arena_t *arena)
+{
+   return count_blocks (arena->block) + count_blocks (arena->spare);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef KMS_ARENA_H
+#define KMS_ARENA_H
+
+#include <stddef.h>
+
+/* A bump allocator. Allocations are never freed one at a time: all of them
+ * are freed by kms_arena_destroy, or those since a mark by kms_arena_rewind,
+ * which keeps their memory for the next allocations. Not thread-safe. */
+
+typedef struct _kms_arena_block_t kms_arena_block_t;
+
+typedef struct {
+   kms_arena_block_t *block; /* the current block, then older ones */
+   kms_arena_block_t *spare; /* emptied by kms_arena_rewind */
+} kms_arena_t;
+
+typedef struct {
+   kms_arena_block_t *block;
+   size_t used;
+} kms_arena_mark_t;
+
+kms_arena_t *
+kms_arena_new (void);
+void
+kms_arena_destroy (kms_arena_t *arena);
+void *
+kms_arena_alloc (kms_arena_t *arena, size_t size);
+/* grows the last allocation in place if possible, otherwise copies */
+void *
+kms_arena_realloc (kms_arena_t *arena,
+                   void *ptr,
+                   size_t old_size,
+                   size_t size);
+/* the mark and rewind functions accept a NULL arena and do nothing */
+kms_arena_mark_t
+kms_arena_mark (const kms_arena_t *arena);
+void
+kms_arena_rewind (kms_arena_t *arena, kms_arena_mark_t mark);
+/* blocks in use or kept for reuse, to watch the arena's footprint */
+size_t
+kms_arena_block_count (const kms_arena_t *arena);
+
+#endif /* KMS_ARENA_H */
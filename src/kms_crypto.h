@@ -36,4 +36,66 @@ kms_sha256_hmac (const char *key_input,
                  size_t len,
                  unsigned char *hash_out);
 
+/* incremental SHA-256, for hashing data as it is generated */
+typedef struct _kms_sha256_ctx_t kms_sha256_ctx_t;
+
+kms_sha256_ctx_t *
+kms_sha256_ctx_new (void);
+
+/* a copy of the hash state, to finalize while "ctx" keeps accumulating */
+kms_sha256_ctx_t *
+kms_sha256_ctx_dup (const kms_sha256_ctx_t *ctx);
+
+/* like kms_sha256_ctx_dup, but into an existing "dst" */
+bool
+kms_sha256_ctx_copy (kms_sha256_ctx_t *dst, const kms_sha256_ctx_t *src);
+
+/* start over, as if new */
+bool
+kms_sha256_ctx_reset (kms_sha256_ctx_t *ctx);
+
+bool
+kms_sha256_ctx_update (kms_sha256_ctx_t *ctx, const char *input, size_t len);
+
+bool
+kms_sha256_ctx_final (kms_sha256_ctx_t *ctx, unsigned char *hash_out);
+
+void
+kms_sha256_ctx_destroy (kms_sha256_ctx_t *ctx);
+
+/* an HMAC-SHA256 key with its inner and outer SHA-256 midstates computed
+ * once, for signing many inputs with the same key. safe to share between
+ * threads, kms_sha256_hmac_compute does not modify it. */
+typedef struct _kms_sha256_hmac_t kms_sha256_hmac_t;
+
+kms_sha256_hmac_t *
+kms_sha256_hmac_new (const char *key_input, size_t key_len);
+
+bool
+kms_sha256_hmac_compute (const kms_sha256_hmac_t *hmac,
+                         const char *input,
+                         size_t len,
+                         unsigned char *hash_out);
+
+void
+kms_sha256_hmac_destroy (kms_sha256_hmac_t *hmac);
+
+/* SHA-256 of "n" independent inputs into "hashes", 32 bytes each. hashes
+ * several inputs at once in SIMD lanes where the CPU supports it, otherwise
+ * one at a time with kms_sha256. */
+bool
+kms_sha256_many (size_t n,
+                 const char *const *inputs,
+                 const size_t *lens,
+                 unsigned char *hashes);
+
+/* like kms_sha256_many with a fixed number of lanes: 1 (kms_sha256), or 4, 8,
+ * 16 on x86-64. returns false if this CPU has no such kernel. for tests. */
+bool
+kms_sha256_many_lanes (size_t lanes,
+                       size_t n,
+                       const char *const *inputs,
+                       const size_t *lens,
+                       unsigned char *hashes);
+
 #endif /* KMS_MESSAGE_KMS_CRYPTO_H */
@@ -15,10 +15,13 @@
  */
 
 #include "kms_crypto.h"
+#include "kms_alloc.h"
 
 #include <CommonCrypto/CommonDigest.h>
 #include <CommonCrypto/CommonHMAC.h>
 
+#include <string.h>
+
 int
 kms_crypto_init ()
 {
@@ -50,3 +53,144 @@ kms_sha256_hmac (const char *key_input,
    CCHmac (kCCHmacAlgSHA256, key_input, key_len, input, len, hash_out);
    return true;
 }
+
+struct _kms_sha256_ctx_t {
+   CC_SHA256_CTX ctx;
+};
+
+kms_sha256_ctx_t *
+kms_sha256_ctx_new (void)
+{
+   kms_sha256_ctx_t *ctx = kms_malloc (sizeof (kms_sha256_ctx_t));
+
+   if (!ctx) {
+      return NULL;
+   }
+
+   CC_SHA256_Init (&ctx->ctx);
+   return ctx;
+}
+
+kms_sha256_ctx_t *
+kms_sha256_ctx_dup (const kms_sha256_ctx_t *ctx)
+{
+   kms_sha256_ctx_t *dup = kms_malloc (sizeof (kms_sha256_ctx_t));
+
+   if (!dup) {
+      return NULL;
+   }
+
+   *dup = *ctx;
+   return dup;
+}
+
+bool
+kms_sha256_ctx_copy (kms_sha256_ctx_t *dst, const kms_sha256_ctx_t *src)
+{
+   *dst = *src;
+   return true;
+}
+
+bool
+kms_sha256_ctx_reset (kms_sha256_ctx_t *ctx)
+{
+   CC_SHA256_Init (&ctx->ctx);
+   return true;
+}
+
+bool
+kms_sha256_ctx_update (kms_sha256_ctx_t *ctx, const char *input, size_t len)
+{
+   CC_SHA256_Update (&ctx->ctx, input, len);
+   return true;
+}
+
+bool
+kms_sha256_ctx_final (kms_sha256_ctx_t *ctx, unsigned char *hash_out)
+{
+   CC_SHA256_Final (hash_out, &ctx->ctx);
+   return true;
+}
+
+void
+kms_sha256_ctx_destroy (kms_sha256_ctx_t *ctx)
+{
+   kms_free (ctx);
+}
+
+struct _kms_sha256_hmac_t {
+   CC_SHA256_CTX inner; /* after hashing key ^ ipad */
+   CC_SHA256_CTX outer; /* after hashing key ^ opad */
+};
+
+static void
+init_padded (CC_SHA256_CTX *ctx,
+             const unsigned char *key,
+             unsigned char pad_byte)
+{
+   unsigned char pad[CC_SHA256_BLOCK_BYTES];
+   size_t i;
+
+   for (i = 0; i < CC_SHA256_BLOCK_BYTES; i++) {
+      pad[i] = key[i] ^ pad_byte;
+   }
+
+   CC_SHA256_Init (ctx);
+   CC_SHA256_Update (ctx, pad, CC_SHA256_BLOCK_BYTES);
+   memset (pad, 0, sizeof (pad));
+}
+
+kms_sha256_hmac_t *
+kms_sha256_hmac_new (const char *key_input, size_t key_len)
+{
+   kms_sha256_hmac_t *hmac = kms_calloc (1, sizeof (kms_sha256_hmac_t));
+   unsigned char key[CC_SHA256_BLOCK_BYTES] = {0};
+
+   if (!hmac) {
+      return NULL;
+   }
+
+   /* RFC 2104: keys longer than the block size are hashed first */
+   if (key_len > CC_SHA256_BLOCK_BYTES) {
+      kms_sha256 (key_input, key_len, key);
+   } else {
+      memcpy (key, key_input, key_len);
+   }
+
+   init_padded (&hmac->inner, key, 0x36);
+   init_padded (&hmac->outer, key, 0x5c);
+   memset (key, 0, sizeof (key));
+
+   return hmac;
+}
+
+bool
+kms_sha256_hmac_compute (const kms_sha256_hmac_t *hmac,
+                         const char *input,
+                         size_t len,
+                         unsigned char *hash_out)
+{
+   CC_SHA256_CTX ctx;
+   unsigned char inner_hash[CC_SHA256_DIGEST_LENGTH];
+
+   ctx = hmac->inner;
+   CC_SHA256_Update (&ctx, input, len);
+   CC_SHA256_Final (inner_hash, &ctx);
+
+   ctx = hmac->outer;
+   CC_SHA256_Update (&ctx, inner_hash, sizeof (inner_hash));
+   CC_SHA256_Final (hash_out, &ctx);
+
+   return true;
+}
+
+void
+kms_sha256_hmac_destroy (kms_sha256_hmac_t *hmac)
+{
+   if (!hmac) {
+      return;
+   }
+
+   memset (hmac, 0, sizeof (kms_sha256_hmac_t));
+   kms_free (hmac);
+}
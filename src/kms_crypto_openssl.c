@@ -15,24 +15,29 @@
  */
 
 #include "kms_crypto.h"
+#include "kms_alloc.h"
 
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 
+#include <string.h>
+
+#define SHA256_BLOCK_LEN 64
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || \
    (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
 static EVP_MD_CTX *
 EVP_MD_CTX_new (void)
 {
-   return calloc (sizeof (EVP_MD_CTX), 1);
+   return kms_calloc (sizeof (EVP_MD_CTX), 1);
 }
 
 static void
 EVP_MD_CTX_free (EVP_MD_CTX *ctx)
 {
    EVP_MD_CTX_cleanup (ctx);
-   free (ctx);
+   kms_free (ctx);
 }
 #endif
 
@@ -84,3 +89,199 @@ kms_sha256_hmac (const char *key_input,
                 hash_out,
                 NULL) != NULL;
 }
+
+struct _kms_sha256_ctx_t {
+   EVP_MD_CTX *digest_ctxp;
+};
+
+kms_sha256_ctx_t *
+kms_sha256_ctx_new (void)
+{
+   kms_sha256_ctx_t *ctx = kms_malloc (sizeof (kms_sha256_ctx_t));
+
+   if (!ctx) {
+      return NULL;
+   }
+
+   ctx->digest_ctxp = EVP_MD_CTX_new ();
+   if (!ctx->digest_ctxp ||
+       1 != EVP_DigestInit_ex (ctx->digest_ctxp, EVP_sha256 (), NULL)) {
+      kms_sha256_ctx_destroy (ctx);
+      return NULL;
+   }
+
+   return ctx;
+}
+
+kms_sha256_ctx_t *
+kms_sha256_ctx_dup (const kms_sha256_ctx_t *ctx)
+{
+   kms_sha256_ctx_t *dup = kms_malloc (sizeof (kms_sha256_ctx_t));
+
+   if (!dup) {
+      return NULL;
+   }
+
+   dup->digest_ctxp = EVP_MD_CTX_new ();
+   if (!dup->digest_ctxp ||
+       1 != EVP_MD_CTX_copy_ex (dup->digest_ctxp, ctx->digest_ctxp)) {
+      kms_sha256_ctx_destroy (dup);
+      return NULL;
+   }
+
+   return dup;
+}
+
+bool
+kms_sha256_ctx_copy (kms_sha256_ctx_t *dst, const kms_sha256_ctx_t *src)
+{
+   return 1 == EVP_MD_CTX_copy_ex (dst->digest_ctxp, src->digest_ctxp);
+}
+
+bool
+kms_sha256_ctx_reset (kms_sha256_ctx_t *ctx)
+{
+   return 1 == EVP_DigestInit_ex (ctx->digest_ctxp, EVP_sha256 (), NULL);
+}
+
+bool
+kms_sha256_ctx_update (kms_sha256_ctx_t *ctx, const char *input, size_t len)
+{
+   return 1 == EVP_DigestUpdate (ctx->digest_ctxp, input, len);
+}
+
+bool
+kms_sha256_ctx_final (kms_sha256_ctx_t *ctx, unsigned char *hash_out)
+{
+   return 1 == EVP_DigestFinal_ex (ctx->digest_ctxp, hash_out, NULL);
+}
+
+void
+kms_sha256_ctx_destroy (kms_sha256_ctx_t *ctx)
+{
+   if (!ctx) {
+      return;
+   }
+
+   if (ctx->digest_ctxp) {
+      EVP_MD_CTX_free (ctx->digest_ctxp);
+   }
+
+   kms_free (ctx);
+}
+
+struct _kms_sha256_hmac_t {
+   EVP_MD_CTX *inner; /* after hashing key ^ ipad */
+   EVP_MD_CTX *outer; /* after hashing key ^ opad */
+};
+
+static bool
+init_padded (EVP_MD_CTX *ctx,
+             const unsigned char *key,
+             unsigned char pad_byte)
+{
+   unsigned char pad[SHA256_BLOCK_LEN];
+   bool rval;
+   size_t i;
+
+   for (i = 0; i < SHA256_BLOCK_LEN; i++) {
+      pad[i] = key[i] ^ pad_byte;
+   }
+
+   rval = 1 == EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL) &&
+          1 == EVP_DigestUpdate (ctx, pad, SHA256_BLOCK_LEN);
+   memset (pad, 0, sizeof (pad));
+
+   return rval;
+}
+
+kms_sha256_hmac_t *
+kms_sha256_hmac_new (const char *key_input, size_t key_len)
+{
+   kms_sha256_hmac_t *hmac = kms_calloc (1, sizeof (kms_sha256_hmac_t));
+   unsigned char key[SHA256_BLOCK_LEN] = {0};
+   bool ok = false;
+
+   if (!hmac) {
+      return NULL;
+   }
+
+   /* RFC 2104: keys longer than the block size are hashed first */
+   if (key_len > SHA256_BLOCK_LEN) {
+      if (!kms_sha256 (key_input, key_len, key)) {
+         goto done;
+      }
+   } else {
+      memcpy (key, key_input, key_len);
+   }
+
+   hmac->inner = EVP_MD_CTX_new ();
+   hmac->outer = EVP_MD_CTX_new ();
+   if (!hmac->inner || !hmac->outer) {
+      goto done;
+   }
+
+   ok = init_padded (hmac->inner, key, 0x36) &&
+        init_padded (hmac->outer, key, 0x5c);
+
+done:
+   memset (key, 0, sizeof (key));
+   if (!ok) {
+      kms_sha256_hmac_destroy (hmac);
+      hmac = NULL;
+   }
+
+   return hmac;
+}
+
+bool
+kms_sha256_hmac_compute (const kms_sha256_hmac_t *hmac,
+                         const char *input,
+                         size_t len,
+                         unsigned char *hash_out)
+{
+   /* a ctx per call, "hmac" may be in use by other threads */
+   EVP_MD_CTX *digest_ctxp = EVP_MD_CTX_new ();
+   unsigned char inner_hash[32];
+   bool rval = false;
+
+   if (!digest_ctxp) {
+      return false;
+   }
+
+   if (1 != EVP_MD_CTX_copy_ex (digest_ctxp, hmac->inner) ||
+       1 != EVP_DigestUpdate (digest_ctxp, input, len) ||
+       1 != EVP_DigestFinal_ex (digest_ctxp, inner_hash, NULL)) {
+      goto cleanup;
+   }
+
+   if (1 != EVP_MD_CTX_copy_ex (digest_ctxp, hmac->outer) ||
+       1 != EVP_DigestUpdate (digest_ctxp, inner_hash, sizeof (inner_hash))) {
+      goto cleanup;
+   }
+
+   rval = (1 == EVP_DigestFinal_ex (digest_ctxp, hash_out, NULL));
+
+cleanup:
+   EVP_MD_CTX_free (digest_ctxp);
+
+   return rval;
+}
+
+void
+kms_sha256_hmac_destroy (kms_sha256_hmac_t *hmac)
+{
+   if (!hmac) {
+      return;
+   }
+
+   if (hmac->inner) {
+      EVP_MD_CTX_free (hmac->inner);
+   }
+
+   if (hmac->outer) {
+      EVP_MD_CTX_free (hmac->outer);
+   }
+
+   kms_free (hmac);
+}
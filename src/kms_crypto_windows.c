@@ -15,6 +15,7 @@
  */
 
 #include "kms_crypto.h"
+#include "kms_alloc.h"
 
 // tell windows.h not to include a bunch of headers we don't need:
 #define WIN32_LEAN_AND_MEAN
@@ -126,3 +127,161 @@ cleanup:
 
    return status == STATUS_SUCCESS ? 1 : 0;
 }
+
+struct _kms_sha256_ctx_t {
+   BCRYPT_HASH_HANDLE hHash;
+};
+
+kms_sha256_ctx_t *
+kms_sha256_ctx_new (void)
+{
+   kms_sha256_ctx_t *ctx = kms_calloc (1, sizeof (kms_sha256_ctx_t));
+
+   if (!ctx) {
+      return NULL;
+   }
+
+   if (BCryptCreateHash (_algoSHA256, &ctx->hHash, NULL, 0, NULL, 0, 0) !=
+       STATUS_SUCCESS) {
+      kms_free (ctx);
+      return NULL;
+   }
+
+   return ctx;
+}
+
+kms_sha256_ctx_t *
+kms_sha256_ctx_dup (const kms_sha256_ctx_t *ctx)
+{
+   kms_sha256_ctx_t *dup = kms_calloc (1, sizeof (kms_sha256_ctx_t));
+
+   if (!dup) {
+      return NULL;
+   }
+
+   if (BCryptDuplicateHash (ctx->hHash, &dup->hHash, NULL, 0, 0) !=
+       STATUS_SUCCESS) {
+      kms_free (dup);
+      return NULL;
+   }
+
+   return dup;
+}
+
+bool
+kms_sha256_ctx_copy (kms_sha256_ctx_t *dst, const kms_sha256_ctx_t *src)
+{
+   /* like reset, the hash object is replaced */
+   (void) BCryptDestroyHash (dst->hHash);
+   dst->hHash = NULL;
+
+   return BCryptDuplicateHash (src->hHash, &dst->hHash, NULL, 0, 0) ==
+          STATUS_SUCCESS;
+}
+
+bool
+kms_sha256_ctx_reset (kms_sha256_ctx_t *ctx)
+{
+   /* a CNG hash object can't be reinitialized, replace it */
+   (void) BCryptDestroyHash (ctx->hHash);
+   ctx->hHash = NULL;
+
+   return BCryptCreateHash (_algoSHA256, &ctx->hHash, NULL, 0, NULL, 0, 0) ==
+          STATUS_SUCCESS;
+}
+
+bool
+kms_sha256_ctx_update (kms_sha256_ctx_t *ctx, const char *input, size_t len)
+{
+   return BCryptHashData (ctx->hHash, (PUCHAR) input, (ULONG) len, 0) ==
+          STATUS_SUCCESS;
+}
+
+bool
+kms_sha256_ctx_final (kms_sha256_ctx_t *ctx, unsigned char *hash_out)
+{
+   // Hardcode output length
+   return BCryptFinishHash (ctx->hHash, hash_out, 256 / 8, 0) ==
+          STATUS_SUCCESS;
+}
+
+void
+kms_sha256_ctx_destroy (kms_sha256_ctx_t *ctx)
+{
+   if (!ctx) {
+      return;
+   }
+
+   (void) BCryptDestroyHash (ctx->hHash);
+   kms_free (ctx);
+}
+
+struct _kms_sha256_hmac_t {
+   /* CNG keeps the padded key state in the hash object, duplicate it for
+    * each computation instead of re-keying */
+   BCRYPT_HASH_HANDLE hHash;
+};
+
+kms_sha256_hmac_t *
+kms_sha256_hmac_new (const char *key_input, size_t key_len)
+{
+   kms_sha256_hmac_t *hmac = kms_calloc (1, sizeof (kms_sha256_hmac_t));
+
+   if (!hmac) {
+      return NULL;
+   }
+
+   if (BCryptCreateHash (_algoSHA256Hmac,
+                         &hmac->hHash,
+                         NULL,
+                         0,
+                         (PUCHAR) key_input,
+                         (ULONG) key_len,
+                         0) != STATUS_SUCCESS) {
+      kms_free (hmac);
+      return NULL;
+   }
+
+   return hmac;
+}
+
+bool
+kms_sha256_hmac_compute (const kms_sha256_hmac_t *hmac,
+                         const char *input,
+                         size_t len,
+                         unsigned char *hash_out)
+{
+   BCRYPT_HASH_HANDLE hHash;
+
+   NTSTATUS status = BCryptDuplicateHash (hmac->hHash, &hHash, NULL, 0, 0);
+   if (status != STATUS_SUCCESS) {
+      return 0;
+   }
+
+   status = BCryptHashData (hHash, (PUCHAR) input, (ULONG) len, 0);
+   if (status != STATUS_SUCCESS) {
+      goto cleanup;
+   }
+
+   // Hardcode output length
+   status = BCryptFinishHash (hHash, hash_out, 256 / 8, 0);
+   if (status != STATUS_SUCCESS) {
+      goto cleanup;
+   }
+
+cleanup:
+   (void) BCryptDestroyHash (hHash);
+
+   return status == STATUS_SUCCESS ? 1 : 0;
+}
+
+void
+kms_sha256_hmac_destroy (kms_sha256_hmac_t *hmac)
+{
+   if (!hmac) {
+      return;
+   }
+
+   (void) BCryptDestroyHash (hmac->hHash);
+   kms_free (hmac);
+}
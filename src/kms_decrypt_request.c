@@ -16,6 +16,7 @@
  */
 
 #include "kms_message/kms_message.h"
+#include "kms_alloc.h"
 #include "kms_message_private.h"
 #include "kms_message/kms_b64.h"
 #include "kms_request_str.h"
@@ -45,7 +46,7 @@ kms_decrypt_request_new (const uint8_t *ciphertext_blob,
 
    b64_len = (len / 3 + 1) * 4 + 1;
 
-   if (!(b64 = malloc (b64_len))) {
+   if (!(b64 = kms_malloc (b64_len))) {
       KMS_ERROR (request,
                  "Could not allocate %d bytes for base64-encoding payload",
                  b64_len);
@@ -62,7 +63,7 @@ kms_decrypt_request_new (const uint8_t *ciphertext_blob,
    kms_request_append_payload (request, payload->str, payload->len);
 
 done:
-   free (b64);
+   kms_free (b64);
    kms_request_str_destroy (payload);
 
    return request;
@@ -16,6 +16,7 @@
  */
 
 #include "kms_message/kms_message.h"
+#include "kms_alloc.h"
 #include "kms_message_private.h"
 #include "kms_message/kms_b64.h"
 #include "kms_request_str.h"
@@ -44,7 +45,7 @@ kms_encrypt_request_new (const uint8_t *plaintext,
    }
 
    b64_len = (plaintext_length / 3 + 1) * 4 + 1;
-   if (!(b64 = malloc (b64_len))) {
+   if (!(b64 = kms_malloc (b64_len))) {
       KMS_ERROR (request,
                  "Could not allocate %d bytes for base64-encoding payload",
                  b64_len);
@@ -63,7 +64,7 @@ kms_encrypt_request_new (const uint8_t *plaintext,
    kms_request_append_payload (request, payload->str, payload->len);
 
 done:
-   free (b64);
+   kms_free (b64);
    kms_request_str_destroy (payload);
 
    return request;
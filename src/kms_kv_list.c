@@ -16,16 +16,151 @@
  */
 
 #include "kms_kv_list.h"
+#include "kms_alloc.h"
 #include "kms_message/kms_message.h"
 #include "kms_request_str.h"
 #include "kms_port.h"
 #include "sort.h"
 
+#include <assert.h>
+#include <ctype.h>
+
+#define WELL_KNOWN(_name, _id) {_name, sizeof (_name) - 1, _id}
+
+/* in kms_header_id_t order */
+static const struct {
+   const char *name;
+   size_t len;
+   kms_header_id_t id;
+} well_known_headers[] = {
+   WELL_KNOWN ("connection", KMS_HEADER_CONNECTION),
+   WELL_KNOWN ("content-length", KMS_HEADER_CONTENT_LENGTH),
+   WELL_KNOWN ("content-type", KMS_HEADER_CONTENT_TYPE),
+   WELL_KNOWN ("host", KMS_HEADER_HOST),
+   WELL_KNOWN ("x-amz-content-sha256", KMS_HEADER_X_AMZ_CONTENT_SHA256),
+   WELL_KNOWN ("x-amz-date", KMS_HEADER_X_AMZ_DATE),
+   WELL_KNOWN ("x-amz-target", KMS_HEADER_X_AMZ_TARGET)};
+
+#undef WELL_KNOWN
+
+kms_header_id_t
+kms_header_id (const kms_request_str_t *lower)
+{
+   size_t i;
+
+   for (i = 0; i < sizeof (well_known_headers) / sizeof (well_known_headers[0]);
+        i++) {
+      if (lower->len == well_known_headers[i].len &&
+          0 == memcmp (lower->str, well_known_headers[i].name, lower->len)) {
+         return well_known_headers[i].id;
+      }
+   }
+
+   return KMS_HEADER_OTHER;
+}
+
+/* lists this long or longer keep a hash index, shorter ones are scanned */
+#define KV_INDEX_MIN 16
+
+/* lowercase like kms_request_str_append_lowercase, skipping non-ASCII UTF-8 */
+static char
+fold (char c)
+{
+   return (c & 0x80) ? c : (char) tolower (c);
+}
+
+/* FNV-1a over the lowercased key */
+static uint32_t
+fold_hash (const char *key, size_t len)
+{
+   uint32_t h = 2166136261u;
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      h ^= (unsigned char) fold (key[i]);
+      h *= 16777619u;
+   }
+
+   return h;
+}
+
 static void
-kv_init (kms_kv_t *kv, kms_request_str_t *key, kms_request_str_t *value)
+index_insert (kms_kv_list_t *lst, size_t i)
 {
-   kv->key = kms_request_str_dup (key);
-   kv->value = kms_request_str_dup (value);
+   size_t mask = lst->index_size - 1;
+   size_t slot = lst->kvs[i].hash & mask;
+
+   while (lst->index[slot]) {
+      slot = (slot + 1) & mask;
+   }
+
+   lst->index[slot] = i + 1;
+}
+
+/* call whenever entries move. keeps the load factor at most 1/2 */
+static void
+index_rebuild (kms_kv_list_t *lst)
+{
+   size_t index_size;
+   size_t i;
+
+   if (lst->len < KV_INDEX_MIN) {
+      kms_free (lst->index);
+      lst->index = NULL;
+      lst->index_size = 0;
+      return;
+   }
+
+   index_size = 2 * KV_INDEX_MIN;
+   while (index_size < 2 * lst->len) {
+      index_size *= 2;
+   }
+
+   if (index_size == lst->index_size) {
+      memset (lst->index, 0, index_size * sizeof (size_t));
+   } else {
+      kms_free (lst->index);
+      lst->index_size = index_size;
+      lst->index = kms_calloc (index_size, sizeof (size_t));
+   }
+
+   for (i = 0; i < lst->len; i++) {
+      index_insert (lst, i);
+   }
+}
+
+static void *
+list_alloc (kms_arena_t *arena, size_t size)
+{
+   return arena ? kms_arena_alloc (arena, size) : kms_malloc (size);
+}
+
+static void
+kv_alloc (kms_kv_t *kv, kms_arena_t *arena)
+{
+   kv->key = kms_request_str_new_in (arena);
+   kv->value = kms_request_str_new_in (arena);
+   kv->lower = kms_request_str_new_in (arena);
+}
+
+/* after setting kv->key */
+static void
+kv_set_lower (kms_kv_t *kv)
+{
+   kv->lower->len = 0;
+   kms_request_str_append_lowercase (kv->lower, kv->key);
+   kv->id = kms_header_id (kv->lower);
+   kv->hash = fold_hash (kv->lower->str, kv->lower->len);
+}
+
+static void
+kv_copy (kms_kv_t *kv, kms_arena_t *arena, const kms_kv_t *src)
+{
+   kv->key = kms_request_str_dup_in (arena, src->key);
+   kv->value = kms_request_str_dup_in (arena, src->value);
+   kv->lower = kms_request_str_dup_in (arena, src->lower);
+   kv->id = src->id;
+   kv->hash = src->hash;
 }
 
 static void
@@ -33,20 +168,31 @@ kv_cleanup (kms_kv_t *kv)
 {
    kms_request_str_destroy (kv->key);
    kms_request_str_destroy (kv->value);
+   kms_request_str_destroy (kv->lower);
 }
 
 kms_kv_list_t *
-kms_kv_list_new (void)
+kms_kv_list_new_in (kms_arena_t *arena)
 {
-   kms_kv_list_t *lst = malloc (sizeof (kms_kv_list_t));
+   kms_kv_list_t *lst = list_alloc (arena, sizeof (kms_kv_list_t));
 
    lst->size = 16;
-   lst->kvs = malloc (lst->size * sizeof (kms_kv_t));
+   lst->kvs = list_alloc (arena, lst->size * sizeof (kms_kv_t));
    lst->len = 0;
+   lst->kept = 0;
+   lst->index = NULL;
+   lst->index_size = 0;
+   lst->arena = arena;
 
    return lst;
 }
 
+kms_kv_list_t *
+kms_kv_list_new (void)
+{
+   return kms_kv_list_new_in (NULL);
+}
+
 void
 kms_kv_list_destroy (kms_kv_list_t *lst)
 {
@@ -56,35 +202,165 @@ kms_kv_list_destroy (kms_kv_list_t *lst)
       return;
    }
 
-   for (i = 0; i < lst->len; i++) {
+   kms_free (lst->index);
+   if (lst->arena) {
+      /* everything else goes with the arena */
+      return;
+   }
+
+   for (i = 0; i < lst->kept; i++) {
       kv_cleanup (&lst->kvs[i]);
    }
 
-   free (lst->kvs);
-   free (lst);
+   kms_free (lst->kvs);
+   kms_free (lst);
+}
+
+void
+kms_kv_list_clear (kms_kv_list_t *lst)
+{
+   lst->len = 0;
+   index_rebuild (lst);
 }
 
 void
 kms_kv_list_add (kms_kv_list_t *lst,
                  kms_request_str_t *key,
                  kms_request_str_t *value)
+{
+   kms_kv_list_add_chars (lst, key->str, key->len, value->str, value->len);
+}
+
+/* the next entry, fill it in and call push_done */
+static kms_kv_t *
+push (kms_kv_list_t *lst)
 {
    if (lst->len == lst->size) {
       lst->size *= 2;
-      lst->kvs = realloc (lst->kvs, lst->size * sizeof (kms_kv_t));
+      if (lst->arena) {
+         lst->kvs = kms_arena_realloc (lst->arena,
+                                       lst->kvs,
+                                       lst->len * sizeof (kms_kv_t),
+                                       lst->size * sizeof (kms_kv_t));
+      } else {
+         lst->kvs = kms_realloc (lst->kvs, lst->size * sizeof (kms_kv_t));
+      }
    }
 
-   kv_init (&lst->kvs[lst->len], key, value);
+   return &lst->kvs[lst->len];
+}
+
+static void
+push_done (kms_kv_list_t *lst)
+{
    ++lst->len;
+
+   if (lst->index && 2 * lst->len <= lst->index_size) {
+      index_insert (lst, lst->len - 1);
+   } else if (lst->len >= KV_INDEX_MIN) {
+      /* build it, or grow it */
+      index_rebuild (lst);
+   }
 }
 
+void
+kms_kv_list_add_chars (kms_kv_list_t *lst,
+                       const char *key,
+                       size_t key_len,
+                       const char *value,
+                       size_t value_len)
+{
+   kms_kv_t *kv = push (lst);
+
+   if (lst->len == lst->kept) {
+      kv_alloc (kv, lst->arena);
+      lst->kept++;
+   }
+
+   kms_request_str_set_chars (kv->key, key, (ssize_t) key_len);
+   kms_request_str_set_chars (kv->value, value, (ssize_t) value_len);
+   kv_set_lower (kv);
+   push_done (lst);
+}
+
+void
+kms_kv_list_add_take (kms_kv_list_t *lst,
+                      kms_request_str_t *key,
+                      kms_request_str_t *value)
+{
+   kms_kv_t *kv = push (lst);
+
+   assert (key->arena == lst->arena && value->arena == lst->arena);
+
+   if (lst->len == lst->kept) {
+      kv->lower = kms_request_str_new_in (lst->arena);
+      lst->kept++;
+   } else {
+      /* a cleared entry, only its lowercase key is reused */
+      kms_request_str_destroy (kv->key);
+      kms_request_str_destroy (kv->value);
+   }
+
+   kv->key = key;
+   kv->value = value;
+   kv_set_lower (kv);
+   push_done (lst);
+}
+
+/* the first entry with "key", ignoring case */
 const kms_kv_t *
 kms_kv_list_find (const kms_kv_list_t *lst, const char *key)
+{
+   const kms_kv_t *kv;
+   const kms_kv_t *found = NULL;
+   size_t len = strlen (key);
+   size_t mask;
+   size_t slot;
+   size_t i;
+   uint32_t h;
+
+   if (!lst->index) {
+      for (i = 0; i < lst->len; i++) {
+         if (lst->kvs[i].key->len == len &&
+             0 == strcasecmp (lst->kvs[i].key->str, key)) {
+            return &lst->kvs[i];
+         }
+      }
+
+      return NULL;
+   }
+
+   h = fold_hash (key, len);
+   mask = lst->index_size - 1;
+   for (slot = h & mask; lst->index[slot]; slot = (slot + 1) & mask) {
+      kv = &lst->kvs[lst->index[slot] - 1];
+      if (kv->hash != h || kv->lower->len != len || (found && kv > found)) {
+         continue;
+      }
+
+      for (i = 0; i < len && kv->lower->str[i] == fold (key[i]); i++) {
+      }
+
+      if (i == len) {
+         /* keep looking, a duplicate key may have been added earlier */
+         found = kv;
+      }
+   }
+
+   return found;
+}
+
+const kms_kv_t *
+kms_kv_list_find_id (const kms_kv_list_t *lst, kms_header_id_t id)
 {
    size_t i;
 
+   if (lst->index && id != KMS_HEADER_OTHER) {
+      return kms_kv_list_find (lst, well_known_headers[id - 1].name);
+   }
+
    for (i = 0; i < lst->len; i++) {
-      if (0 == strcasecmp (lst->kvs[i].key->str, key)) {
+      if (lst->kvs[i].id == id) {
          return &lst->kvs[i];
       }
    }
@@ -92,49 +368,164 @@ kms_kv_list_find (const kms_kv_list_t *lst, const char *key)
    return NULL;
 }
 
+/* delete all entries with "key", case-sensitive */
 void
 kms_kv_list_del (kms_kv_list_t *lst, const char *key)
 {
-   size_t i;
+   size_t i, n;
 
-   for (i = 0; i < lst->len; i++) {
+   if (lst->index && !kms_kv_list_find (lst, key)) {
+      return;
+   }
+
+   /* shift the survivors down, keeping their order */
+   for (i = 0, n = 0; i < lst->len; i++) {
       if (0 == strcmp (lst->kvs[i].key->str, key)) {
          kv_cleanup (&lst->kvs[i]);
-         memmove (&lst->kvs[i],
-                  &lst->kvs[i + 1],
-                  sizeof (kms_kv_t) * (lst->len - i - 1));
-         lst->len--;
+         continue;
       }
+
+      lst->kvs[n++] = lst->kvs[i];
+   }
+
+   if (n != lst->len) {
+      /* and the entries kept for reuse after them */
+      memmove (&lst->kvs[n],
+               &lst->kvs[lst->len],
+               (lst->kept - lst->len) * sizeof (kms_kv_t));
+      lst->kept -= lst->len - n;
+      lst->len = n;
+      index_rebuild (lst);
    }
 }
 
 kms_kv_list_t *
-kms_kv_list_dup (const kms_kv_list_t *lst)
+kms_kv_list_dup_in (kms_arena_t *arena, const kms_kv_list_t *lst)
 {
    kms_kv_list_t *dup;
    size_t i;
 
    if (lst->len == 0) {
-      return kms_kv_list_new ();
+      return kms_kv_list_new_in (arena);
    }
 
-   dup = malloc (sizeof (kms_kv_list_t));
-   dup->size = dup->len = lst->len;
-   dup->kvs = malloc (lst->len * sizeof (kms_kv_t));
+   dup = list_alloc (arena, sizeof (kms_kv_list_t));
+   dup->size = dup->len = dup->kept = lst->len;
+   dup->kvs = list_alloc (arena, lst->len * sizeof (kms_kv_t));
+   dup->index = NULL;
+   dup->index_size = 0;
+   dup->arena = arena;
 
    for (i = 0; i < lst->len; i++) {
-      kv_init (&dup->kvs[i], lst->kvs[i].key, lst->kvs[i].value);
+      kv_copy (&dup->kvs[i], arena, &lst->kvs[i]);
    }
 
+   index_rebuild (dup);
+
    return dup;
 }
 
+kms_kv_list_t *
+kms_kv_list_dup (const kms_kv_list_t *lst)
+{
+   return kms_kv_list_dup_in (NULL, lst);
+}
+
+int
+kms_kv_cmp_keys (const kms_kv_t *a, const kms_kv_t *b)
+{
+   size_t len = a->lower->len < b->lower->len ? a->lower->len : b->lower->len;
+   int r = memcmp (a->lower->str, b->lower->str, len);
+
+   if (r != 0 || a->lower->len == b->lower->len) {
+      return r;
+   }
+
+   return a->lower->len < b->lower->len ? -1 : 1;
+}
+
+bool
+kms_kv_same_key (const kms_kv_t *a, const kms_kv_t *b)
+{
+   if (a->id != KMS_HEADER_OTHER || b->id != KMS_HEADER_OTHER) {
+      return a->id == b->id;
+   }
+
+   return a->lower->len == b->lower->len &&
+          0 == memcmp (a->lower->str, b->lower->str, a->lower->len);
+}
+
+void
+kms_kv_list_sort_ptrs (const kms_kv_list_t *lst,
+                       const void **ptrs,
+                       int (*cmp) (const void *, const void *))
+{
+   size_t i;
+
+   for (i = 0; i < lst->len; i++) {
+      ptrs[i] = &lst->kvs[i];
+   }
+
+   mergesort_ptrs (ptrs, ptrs + lst->len, lst->len, cmp);
+}
 
 void
 kms_kv_list_sort (kms_kv_list_t *lst, int (*cmp) (const void *, const void *))
 {
+   const void *stack_ptrs[2 * KV_SORT_STACK];
+   kms_kv_t stack_kvs[KV_SORT_STACK];
+   const void **ptrs = stack_ptrs;
+   kms_kv_t *sorted = stack_kvs;
+   kms_kv_t tmp;
+   size_t i, j;
+
+   if (lst->len < 2) {
+      return;
+   }
+
+   if (lst->len > KV_SORT_STACK) {
+      ptrs = kms_malloc (2 * lst->len * sizeof (void *));
+      sorted = kms_malloc (lst->len * sizeof (kms_kv_t));
+      if (!ptrs || !sorted) {
+         kms_free ((void *) ptrs);
+         kms_free (sorted);
+         ptrs = NULL;
+      }
+   }
+
    /* A stable sort is required to sort headers when creating canonical
     * requests. qsort is not stable. */
-   insertionsort (
-      (unsigned char *) (lst->kvs), lst->len, sizeof (kms_kv_t), cmp);
+   if (lst->len <= MERGESORT_RUN || !ptrs) {
+      /* the usual handful of headers, or out of memory: insertion sort them
+       * in place */
+      for (i = 1; i < lst->len; i++) {
+         tmp = lst->kvs[i];
+         for (j = i; j > 0 && cmp (&lst->kvs[j - 1], &tmp) > 0; j--) {
+            lst->kvs[j] = lst->kvs[j - 1];
+         }
+
+         lst->kvs[j] = tmp;
+      }
+
+      goto done;
+   }
+
+   /* sort pointers and move each pair once */
+   kms_kv_list_sort_ptrs (lst, ptrs, cmp);
+
+   for (i = 0; i < lst->len; i++) {
+      sorted[i] = *(const kms_kv_t *) ptrs[i];
+   }
+
+   memcpy (lst->kvs, sorted, lst->len * sizeof (kms_kv_t));
+
+   if (ptrs != stack_ptrs) {
+      kms_free ((void *) ptrs);
+      kms_free (sorted);
+   }
+
+done:
+   if (lst->index) {
+      index_rebuild (lst);
+   }
 }
@@ -24,33 +24,98 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/* header names the signing code looks for */
+typedef enum {
+   KMS_HEADER_OTHER = 0,
+   KMS_HEADER_CONNECTION,
+   KMS_HEADER_CONTENT_LENGTH,
+   KMS_HEADER_CONTENT_TYPE,
+   KMS_HEADER_HOST,
+   KMS_HEADER_X_AMZ_CONTENT_SHA256,
+   KMS_HEADER_X_AMZ_DATE,
+   KMS_HEADER_X_AMZ_TARGET
+} kms_header_id_t;
+
 /* key-value pair */
 typedef struct {
    kms_request_str_t *key;
    kms_request_str_t *value;
+   /* the key lowercased once when added, and its id if it is well-known */
+   kms_request_str_t *lower;
+   kms_header_id_t id;
+   uint32_t hash; /* of "lower" */
 } kms_kv_t;
 
 typedef struct {
    kms_kv_t *kvs;
    size_t len;
    size_t size;
+   /* entries from len up to here were removed by kms_kv_list_clear, the next
+    * adds reuse their strings */
+   size_t kept;
+   /* open-addressing hash index over the lowercase keys, kept once the list
+    * is long enough. slots hold an index into kvs plus 1, or 0 if empty */
+   size_t *index;
+   size_t index_size; /* a power of 2 */
+   /* if set, the list, its entries and their strings are freed with it */
+   kms_arena_t *arena;
 } kms_kv_list_t;
 
 kms_kv_list_t *
 kms_kv_list_new (void);
+kms_kv_list_t *
+kms_kv_list_new_in (kms_arena_t *arena);
 void
 kms_kv_list_destroy (kms_kv_list_t *lst);
+/* remove all entries, keeping their memory for the next adds */
+void
+kms_kv_list_clear (kms_kv_list_t *lst);
 void
 kms_kv_list_add (kms_kv_list_t *lst,
                  kms_request_str_t *key,
                  kms_request_str_t *value);
+void
+kms_kv_list_add_chars (kms_kv_list_t *lst,
+                       const char *key,
+                       size_t key_len,
+                       const char *value,
+                       size_t value_len);
+/* like kms_kv_list_add, but the list adopts "key" and "value" instead of
+ * copying them. they must be from the list's arena, or the heap if none.
+ * for strings already built, like the response parser's header lines; a
+ * list that is reset and refilled does better with kms_kv_list_add_chars,
+ * which copies into the entries it kept */
+void
+kms_kv_list_add_take (kms_kv_list_t *lst,
+                      kms_request_str_t *key,
+                      kms_request_str_t *value);
 const kms_kv_t *
 kms_kv_list_find (const kms_kv_list_t *lst, const char *key);
+const kms_kv_t *
+kms_kv_list_find_id (const kms_kv_list_t *lst, kms_header_id_t id);
 void
 kms_kv_list_del (kms_kv_list_t *lst, const char *key);
 kms_kv_list_t *
 kms_kv_list_dup (const kms_kv_list_t *lst);
+kms_kv_list_t *
+kms_kv_list_dup_in (kms_arena_t *arena, const kms_kv_list_t *lst);
+kms_header_id_t
+kms_header_id (const kms_request_str_t *lower);
+/* compare keys case-insensitively, like strcasecmp */
+int
+kms_kv_cmp_keys (const kms_kv_t *a, const kms_kv_t *b);
+bool
+kms_kv_same_key (const kms_kv_t *a, const kms_kv_t *b);
+/* lists up to this long are sorted without allocating */
+#define KV_SORT_STACK 16
+
 void
 kms_kv_list_sort (kms_kv_list_t *lst, int (*cmp) (const void *, const void *));
+/* stable sort pointers to the entries into "ptrs", leaving the list as it is.
+ * "ptrs" has room for 2 * len pointers, the second half is scratch */
+void
+kms_kv_list_sort_ptrs (const kms_kv_list_t *lst,
+                       const void **ptrs,
+                       int (*cmp) (const void *, const void *));
 
 #endif /* KMS_KV_LIST_H */
@@ -19,6 +19,7 @@
 #include "kms_message/kms_message.h"
 #include "kms_message_private.h"
 #include "kms_crypto.h"
+#include "kms_signing_key_cache.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -43,5 +44,6 @@ kms_message_init (void)
 void
 kms_message_cleanup (void)
 {
+   kms_signing_key_cache_clear ();
    kms_crypto_cleanup ();
 }
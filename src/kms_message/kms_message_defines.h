@@ -17,6 +17,7 @@
 #ifndef KMS_MESSAGE_DEFINES_H
 #define KMS_MESSAGE_DEFINES_H
 
+#include <stddef.h>
 
 #ifdef _MSC_VER
 #ifdef KMS_MSG_STATIC
@@ -44,6 +45,20 @@
 extern "C" {
 #endif
 
+/* a replacement for malloc, realloc and free. "ctx" is passed to each */
+typedef struct {
+   void *(*malloc_fn) (size_t size, void *ctx);
+   void *(*realloc_fn) (void *ptr, size_t size, void *ctx);
+   void (*free_fn) (void *ptr, void *ctx);
+   void *ctx;
+} kms_message_allocator_t;
+
+/* route all of the library's allocations through "allocator", or back to
+ * malloc, realloc and free if NULL. call before kms_message_init, and again
+ * only after kms_message_cleanup once every object is destroyed. strings the
+ * library returns must then be freed with kms_request_free_string */
+KMS_MSG_EXPORT (void)
+kms_message_set_allocator (const kms_message_allocator_t *allocator);
 KMS_MSG_EXPORT (int)
 kms_message_init (void);
 KMS_MSG_EXPORT (void)
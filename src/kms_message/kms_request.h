@@ -29,17 +29,45 @@ extern "C" {
 #endif
 
 typedef struct _kms_request_t kms_request_t;
+typedef struct _kms_request_template_t kms_request_template_t;
+
+/* layout-compatible with POSIX struct iovec, for writev and sendmsg */
+typedef struct {
+   const void *iov_base;
+   size_t iov_len;
+} kms_request_iovec_t;
 
 KMS_MSG_EXPORT (kms_request_t *)
 kms_request_new (const char *method,
                  const char *path_and_query,
                  const kms_request_opt_t *opt);
+/* the template must outlive requests made from it */
+KMS_MSG_EXPORT (kms_request_t *)
+kms_request_new_from_template (const kms_request_template_t *tmpl);
+/* a full copy, except that a copy of a templated request shares the
+ * template's frozen parts. returns NULL if out of memory */
+KMS_MSG_EXPORT (kms_request_t *)
+kms_request_dup (const kms_request_t *request);
 KMS_MSG_EXPORT (void)
 kms_request_destroy (kms_request_t *request);
+/* like destroying the request and making a new one, but keeps its memory
+ * for reuse. it keeps its arena, if it has one, whatever "opt" says */
+KMS_MSG_EXPORT (bool)
+kms_request_reset (kms_request_t *request,
+                   const char *method,
+                   const char *path_and_query,
+                   const kms_request_opt_t *opt);
+KMS_MSG_EXPORT (kms_request_template_t *)
+kms_request_template_new (kms_request_t *request);
+KMS_MSG_EXPORT (void)
+kms_request_template_destroy (kms_request_template_t *tmpl);
 KMS_MSG_EXPORT (const char *)
 kms_request_get_error (kms_request_t *request);
 KMS_MSG_EXPORT (bool)
 kms_request_set_date (kms_request_t *request, const struct tm *tm);
+/* like kms_request_set_date, with seconds since the Unix epoch, UTC */
+KMS_MSG_EXPORT (bool)
+kms_request_set_date_epoch (kms_request_t *request, int64_t seconds);
 KMS_MSG_EXPORT (bool)
 kms_request_set_region (kms_request_t *request, const char *region);
 KMS_MSG_EXPORT (bool)
@@ -60,16 +88,65 @@ KMS_MSG_EXPORT (bool)
 kms_request_append_payload (kms_request_t *request,
                             const char *payload,
                             size_t len);
+KMS_MSG_EXPORT (bool)
+kms_request_append_payload_borrowed (kms_request_t *request,
+                                     const char *payload,
+                                     size_t len);
+KMS_MSG_EXPORT (bool)
+kms_request_set_payload_hash (kms_request_t *request, const uint8_t *hash);
+KMS_MSG_EXPORT (bool)
+kms_request_set_payload_hash_hex (kms_request_t *request, const char *hex);
+KMS_MSG_EXPORT (bool)
+kms_request_set_unsigned_payload (kms_request_t *request);
+/* sign the body as an aws-chunked stream of "chunk_size" byte chunks, then
+ * pass each chunk to kms_request_get_chunk_iov, and finally an empty one */
+KMS_MSG_EXPORT (bool)
+kms_request_set_chunked_upload (kms_request_t *request,
+                                size_t decoded_len,
+                                size_t chunk_size);
+/* the size of the "iov" array kms_request_get_chunk_iov fills */
+#define KMS_REQUEST_CHUNK_IOV_COUNT 3
+/* frames a chunk into "iov": its header, "data" itself and the trailing
+ * CRLF. "iov" must hold KMS_REQUEST_CHUNK_IOV_COUNT entries, the header
+ * stays valid until the next call. returns the count, or 0 on error */
+KMS_MSG_EXPORT (size_t)
+kms_request_get_chunk_iov (kms_request_t *request,
+                           const char *data,
+                           size_t len,
+                           kms_request_iovec_t *iov);
 KMS_MSG_EXPORT (char *)
 kms_request_get_canonical (kms_request_t *request);
 KMS_MSG_EXPORT (char *)
 kms_request_get_string_to_sign (kms_request_t *request);
 KMS_MSG_EXPORT (bool)
 kms_request_get_signing_key (kms_request_t *request, unsigned char *key);
+KMS_MSG_EXPORT (void)
+kms_request_get_signing_key_cache_stats (uint64_t *hits, uint64_t *misses);
 KMS_MSG_EXPORT (char *)
 kms_request_get_signature (kms_request_t *request);
 KMS_MSG_EXPORT (char *)
 kms_request_get_signed (kms_request_t *request);
+KMS_MSG_EXPORT (size_t)
+kms_request_get_signed_len (kms_request_t *request);
+/* write the signed request into "buf", without a nil terminator. returns its
+ * length, or 0 if it needs more than "size" bytes (see
+ * kms_request_get_signed_len) or signing failed (see kms_request_get_error).
+ * a buffer that is too small leaves the request usable */
+KMS_MSG_EXPORT (size_t)
+kms_request_write_signed (kms_request_t *request, char *buf, size_t size);
+KMS_MSG_EXPORT (size_t)
+kms_request_get_signed_iov (kms_request_t *request,
+                            kms_request_iovec_t *iov,
+                            size_t iov_max);
+/* sign all requests into one buffer, free it with kms_request_free_string.
+ * signed_out[i] points into it. returns NULL if any request fails */
+KMS_MSG_EXPORT (char *)
+kms_request_sign_batch (kms_request_t **requests,
+                        size_t n,
+                        kms_request_iovec_t *signed_out);
+/* a URL with the signature in the query, valid for "expires" seconds */
+KMS_MSG_EXPORT (char *)
+kms_request_get_presigned_url (kms_request_t *request, unsigned int expires);
 KMS_MSG_EXPORT (void)
 kms_request_free_string (char* ptr);
 
@@ -34,6 +34,13 @@ kms_request_opt_destroy (kms_request_opt_t *request);
 KMS_MSG_EXPORT (void)
 kms_request_opt_set_connection_close (kms_request_opt_t *opt,
                                       bool connection_close);
+KMS_MSG_EXPORT (void)
+kms_request_opt_set_content_sha256_header (kms_request_opt_t *opt,
+                                           bool content_sha256_header);
+/* back the request's strings, lists and signing temporaries with a per-request
+ * arena, freed at once by kms_request_destroy */
+KMS_MSG_EXPORT (void)
+kms_request_opt_set_arena (kms_request_opt_t *opt, bool arena);
 
 #ifdef __cplusplus
 } /* extern "C" */
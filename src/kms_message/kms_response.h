@@ -26,6 +26,9 @@ extern "C" {
 typedef struct _kms_response_t kms_response_t;
 
 KMS_MSG_EXPORT (const char *) kms_response_get_body (kms_response_t *reply);
+/* the first header named "name", ignoring case, or NULL */
+KMS_MSG_EXPORT (const char *)
+   kms_response_get_header (kms_response_t *reply, const char *name);
 KMS_MSG_EXPORT (void) kms_response_destroy (kms_response_t *reply);
 
 #ifdef __cplusplus
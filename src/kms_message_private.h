@@ -18,13 +18,48 @@
 #define KMS_MESSAGE_PRIVATE_H
 
 #include "kms_message/kms_message.h"
+#include "kms_crypto.h"
 #include "kms_request_str.h"
 #include "kms_kv_list.h"
 
+/* 64 hex chars or a literal like "UNSIGNED-PAYLOAD", plus nil */
+#define KMS_PAYLOAD_HASH_MAX 65
+
+/* the parts of a request that are the same for every request made from it,
+ * immutable once built */
+struct _kms_request_template_t {
+   kms_request_str_t *region;
+   kms_request_str_t *service;
+   kms_request_str_t *access_key_id;
+   kms_request_str_t *secret_key;
+   kms_request_str_t *method;
+   kms_request_str_t *path;
+   kms_request_str_t *query;
+   kms_kv_list_t *query_params;
+   /* sorted, without X-Amz-Date */
+   kms_kv_list_t *header_fields;
+   /* Host was derived from service and region, not set by the caller */
+   bool auto_host;
+   /* method, normalized path and sorted query of the canonical request */
+   kms_request_str_t *canonical_prefix;
+   bool content_sha256_header;
+   bool auto_content_length;
+   /* requests made from the template get an arena */
+   bool arena;
+};
+
 struct _kms_request_t {
    char error[512];
    bool failed;
    bool finalized;
+   /* if set, backs the fields below and signing temporaries, see
+    * kms_request_opt_set_arena */
+   kms_arena_t *arena;
+   /* the empty arena, kms_request_reset rewinds to it */
+   kms_arena_mark_t arena_start;
+   /* if set, region through query_params point into the template, see
+    * kms_request_new_from_template */
+   const kms_request_template_t *tmpl;
    kms_request_str_t *region;
    kms_request_str_t *service;
    kms_request_str_t *access_key_id;
@@ -33,8 +68,51 @@ struct _kms_request_t {
    kms_request_str_t *path;
    kms_request_str_t *query;
    kms_request_str_t *payload;
-   kms_request_str_t *datetime;
-   kms_request_str_t *date;
+   /* segments from kms_request_append_payload_borrowed, not copied. a payload
+    * is either all copied into "payload" or all borrowed */
+   kms_request_iovec_t *borrowed;
+   size_t borrowed_count;
+   size_t borrowed_size;
+   size_t borrowed_len;
+   /* SHA-256 of the payload, updated as it is appended */
+   kms_sha256_ctx_t *payload_hash_ctx;
+   unsigned char payload_hash[32];
+   bool payload_hash_valid;
+   /* hex hash or literal from the caller, overrides "payload_hash" */
+   char payload_hash_preset[KMS_PAYLOAD_HASH_MAX];
+   /* add an X-Amz-Content-Sha256 header */
+   bool content_sha256_header;
+   /* saved by the last signature, so it can be redone cheaply if only the
+    * date changes: the canonical request hashed up to the X-Amz-Date value,
+    * everything after the value, and the headers in canonical order. kept
+    * for reuse when cleared by forget_signature */
+   kms_sha256_ctx_t *creq_prefix;
+   kms_request_str_t *creq_suffix;
+   bool creq_saved;
+   kms_kv_list_t *sorted_headers;
+   bool headers_sorted;
+   /* reused by each signature: the canonical request's hash, a buffer for
+    * what is not hashed yet, and the normalized path */
+   kms_sha256_ctx_t *creq_hash;
+   kms_request_str_t *creq_buf;
+   kms_request_str_t *creq_path;
+   /* aws-chunked upload, see kms_request_set_chunked_upload */
+   bool chunked;
+   size_t chunk_size;
+   size_t chunk_decoded_len;
+   size_t chunk_remaining; /* bytes not yet sent in chunks */
+   bool chunk_seeded;      /* signed, so chunk_signature is the seed */
+   bool chunk_done;        /* sent the empty final chunk */
+   unsigned char chunk_signature[32]; /* the previous in the chain */
+   struct _kms_signing_key_t *chunk_key;
+   kms_request_str_t *chunk_head; /* frame header for kms_request_get_chunk_iov */
+   /* serialized head for kms_request_get_signed_iov */
+   kms_request_str_t *signed_head;
+   /* embedded, they are never borrowed and rarely outgrow the inline buffer */
+   kms_request_str_t datetime;
+   kms_request_str_t date;
+   /* no date set yet, stamp the current time when signing */
+   bool auto_date;
    kms_kv_list_t *query_params;
    kms_kv_list_t *header_fields;
    /* turn off for tests only, not in public kms_request_opt_t API */
@@ -15,6 +15,12 @@
  * limitations under the License.
  */
 
+#if defined(_MSC_VER)
+#define KMS_THREAD_LOCAL __declspec(thread)
+#else
+#define KMS_THREAD_LOCAL __thread
+#endif
+
 #if defined(_WIN32)
 #define strcasecmp _stricmp
 
@@ -15,44 +15,121 @@
  * limitations under the License.
  */
 
+#include "hexlify.h"
 #include "kms_crypto.h"
+#include "kms_alloc.h"
 #include "kms_message/kms_message.h"
 #include "kms_message_private.h"
 #include "kms_request_opt_private.h"
+#include "kms_signing_key_cache.h"
 #include "kms_port.h"
 
 #include <assert.h>
+#include <ctype.h>
 
-static kms_kv_list_t *
-parse_query_params (kms_request_str_t *q)
+/* add the params in "q" to "lst" */
+static bool
+parse_query_params (kms_kv_list_t *lst, kms_request_str_t *q)
 {
-   kms_kv_list_t *lst = kms_kv_list_new ();
    char *p = q->str;
    char *end = q->str + q->len;
    char *amp, *equals;
-   kms_request_str_t *k, *v;
 
    do {
       equals = strchr ((const char *) p, '=');
       if (!equals) {
-         kms_kv_list_destroy (lst);
-         return NULL;
+         return false;
       }
       amp = strchr ((const char *) equals, '&');
       if (!amp) {
          amp = end;
       }
 
-      k = kms_request_str_new_from_chars (p, equals - p);
-      v = kms_request_str_new_from_chars (equals + 1, amp - equals - 1);
-      kms_kv_list_add (lst, k, v);
-      kms_request_str_destroy (k);
-      kms_request_str_destroy (v);
+      kms_kv_list_add_chars (lst,
+                             p,
+                             (size_t) (equals - p),
+                             equals + 1,
+                             (size_t) (amp - equals - 1));
 
       p = amp + 1;
    } while (p < end);
 
-   return lst;
+   return true;
+}
+
+/* set the method, path and query of a request whose strings exist */
+static void
+set_target (kms_request_t *request,
+            const char *method,
+            const char *path_and_query)
+{
+   const char *question_mark;
+
+   kms_request_str_set_chars (request->method, method, -1);
+   kms_kv_list_clear (request->query_params);
+
+   question_mark = strchr (path_and_query, '?');
+   if (!question_mark) {
+      kms_request_str_set_chars (request->path, path_and_query, -1);
+      kms_request_str_set_chars (request->query, "", 0);
+      return;
+   }
+
+   kms_request_str_set_chars (
+      request->path, path_and_query, question_mark - path_and_query);
+   kms_request_str_set_chars (request->query, question_mark + 1, -1);
+   if (!parse_query_params (request->query_params, request->query)) {
+      KMS_ERROR (request, "Cannot parse query: %s", request->query->str);
+   }
+}
+
+static void
+apply_opt (kms_request_t *request, const kms_request_opt_t *opt)
+{
+   if (opt && opt->connection_close) {
+      kms_request_add_header_field (request, "Connection", "close");
+   }
+
+   if (opt) {
+      request->content_sha256_header = opt->content_sha256_header;
+   }
+}
+
+/* the fields a template shares, for a request that doesn't use one */
+static void
+init_own_fields (kms_request_t *request)
+{
+   kms_arena_t *arena = request->arena;
+
+   request->region = kms_request_str_new_in (arena);
+   request->service = kms_request_str_new_in (arena);
+   request->access_key_id = kms_request_str_new_in (arena);
+   request->secret_key = kms_request_str_new_in (arena);
+   request->method = kms_request_str_new_in (arena);
+   request->path = kms_request_str_new_in (arena);
+   request->query = kms_request_str_new_in (arena);
+   request->query_params = kms_kv_list_new_in (arena);
+}
+
+/* the fields a template does not share */
+static void
+init_per_request (kms_request_t *request)
+{
+   request->payload = kms_request_str_new_in (request->arena);
+   request->signed_head = kms_request_str_new_in (request->arena);
+   kms_request_str_init (&request->date);
+   kms_request_str_init (&request->datetime);
+   request->header_fields = kms_kv_list_new_in (request->arena);
+   request->auto_date = true;
+}
+
+/* drop what the last signature saved for re-signing, see
+ * hash_canonical_request. call before changing anything but the date */
+static void
+forget_signature (kms_request_t *request)
+{
+   request->creq_saved = false;
+   request->headers_sorted = false;
 }
 
 kms_request_t *
@@ -60,65 +137,251 @@ kms_request_new (const char *method,
                  const char *path_and_query,
                  const kms_request_opt_t *opt)
 {
-   kms_request_t *request = calloc (1, sizeof (kms_request_t));
-   const char *question_mark;
+   kms_request_t *request = kms_calloc (1, sizeof (kms_request_t));
+
+   if (opt && opt->arena) {
+      request->arena = kms_arena_new ();
+      /* kms_request_reset rewinds to here */
+      request->arena_start = kms_arena_mark (request->arena);
+   }
 
    /* parsing may set failed to true */
    request->failed = false;
 
    request->finalized = false;
-   request->region = kms_request_str_new ();
-   request->service = kms_request_str_new ();
-   request->access_key_id = kms_request_str_new ();
-   request->secret_key = kms_request_str_new ();
+   init_own_fields (request);
+   set_target (request, method, path_and_query);
+   request->auto_content_length = true;
+   init_per_request (request);
+   apply_opt (request, opt);
 
-   question_mark = strchr (path_and_query, '?');
-   if (question_mark) {
-      request->path = kms_request_str_new_from_chars (
-         path_and_query, question_mark - path_and_query);
-      request->query = kms_request_str_new_from_chars (question_mark + 1, -1);
-      request->query_params = parse_query_params (request->query);
-      if (!request->query_params) {
-         KMS_ERROR (request, "Cannot parse query: %s", request->query->str);
-      }
-   } else {
-      request->path = kms_request_str_new_from_chars (path_and_query, -1);
-      request->query = kms_request_str_new ();
-      request->query_params = kms_kv_list_new ();
+   return request;
+}
+
+kms_request_t *
+kms_request_new_from_template (const kms_request_template_t *tmpl)
+{
+   kms_request_t *request = kms_calloc (1, sizeof (kms_request_t));
+
+   /* borrow everything the template froze, see unshare */
+   request->tmpl = tmpl;
+   request->region = tmpl->region;
+   request->service = tmpl->service;
+   request->access_key_id = tmpl->access_key_id;
+   request->secret_key = tmpl->secret_key;
+   request->method = tmpl->method;
+   request->path = tmpl->path;
+   request->query = tmpl->query;
+   request->query_params = tmpl->query_params;
+   request->content_sha256_header = tmpl->content_sha256_header;
+   request->auto_content_length = tmpl->auto_content_length;
+   if (tmpl->arena) {
+      request->arena = kms_arena_new ();
+      request->arena_start = kms_arena_mark (request->arena);
    }
 
-   request->payload = kms_request_str_new ();
-   request->date = kms_request_str_new ();
-   request->datetime = kms_request_str_new ();
-   request->method = kms_request_str_new_from_chars (method, -1);
-   request->header_fields = kms_kv_list_new ();
-   request->auto_content_length = true;
+   init_per_request (request);
 
-   kms_request_set_date (request, NULL);
+   return request;
+}
 
-   if (opt && opt->connection_close) {
-      kms_request_add_header_field (request, "Connection", "close");
+kms_request_t *
+kms_request_dup (const kms_request_t *request)
+{
+   kms_request_t *dup = kms_malloc (sizeof (kms_request_t));
+
+   kms_arena_t *arena;
+
+   if (!dup) {
+      return NULL;
    }
 
-   return request;
+   *dup = *request;
+
+   /* a copy gets its own arena, if any */
+   dup->arena = request->arena ? kms_arena_new () : NULL;
+   dup->arena_start = kms_arena_mark (dup->arena);
+   arena = dup->arena;
+
+   if (!request->tmpl) {
+      dup->region = kms_request_str_dup_in (arena, request->region);
+      dup->service = kms_request_str_dup_in (arena, request->service);
+      dup->access_key_id =
+         kms_request_str_dup_in (arena, request->access_key_id);
+      dup->secret_key = kms_request_str_dup_in (arena, request->secret_key);
+      dup->method = kms_request_str_dup_in (arena, request->method);
+      dup->path = kms_request_str_dup_in (arena, request->path);
+      dup->query = kms_request_str_dup_in (arena, request->query);
+      dup->query_params =
+         request->query_params
+            ? kms_kv_list_dup_in (arena, request->query_params)
+            : NULL;
+   }
+
+   dup->payload = kms_request_str_dup_in (arena, request->payload);
+   dup->borrowed = NULL;
+   if (request->borrowed_size) {
+      dup->borrowed =
+         kms_malloc (request->borrowed_size * sizeof (kms_request_iovec_t));
+      if (dup->borrowed) {
+         memcpy (dup->borrowed,
+                 request->borrowed,
+                 request->borrowed_count * sizeof (kms_request_iovec_t));
+      } else {
+         dup->borrowed_size = 0;
+         dup->borrowed_count = 0;
+         dup->borrowed_len = 0;
+         KMS_ERROR (dup, "Could not allocate borrowed payload");
+      }
+   }
+
+   dup->payload_hash_ctx = NULL;
+   if (request->payload_hash_ctx) {
+      dup->payload_hash_ctx = kms_sha256_ctx_dup (request->payload_hash_ctx);
+      if (!dup->payload_hash_ctx) {
+         KMS_ERROR (dup, "Could not copy SHA-256 context");
+      }
+   }
+
+   /* not worth copying, it is recomputed on the next signature */
+   dup->creq_prefix = NULL;
+   dup->creq_suffix = NULL;
+   dup->creq_saved = false;
+   dup->sorted_headers = NULL;
+   dup->headers_sorted = false;
+   dup->creq_hash = NULL;
+   dup->creq_buf = NULL;
+   dup->creq_path = NULL;
+   dup->chunk_key = NULL;
+   dup->chunk_head = NULL;
+   dup->signed_head = kms_request_str_new_in (arena);
+   /* embedded, point them at the copy's own buffers */
+   kms_request_str_init (&dup->datetime);
+   kms_request_str_set_chars (
+      &dup->datetime, request->datetime.str, (ssize_t) request->datetime.len);
+   kms_request_str_init (&dup->date);
+   kms_request_str_set_chars (
+      &dup->date, request->date.str, (ssize_t) request->date.len);
+   dup->header_fields = kms_kv_list_dup_in (arena, request->header_fields);
+
+   return dup;
 }
 
 void
 kms_request_destroy (kms_request_t *request)
 {
-   kms_request_str_destroy (request->region);
-   kms_request_str_destroy (request->service);
-   kms_request_str_destroy (request->access_key_id);
-   kms_request_str_destroy (request->secret_key);
-   kms_request_str_destroy (request->method);
-   kms_request_str_destroy (request->path);
-   kms_request_str_destroy (request->query);
+   if (!request->tmpl) {
+      kms_request_str_destroy (request->region);
+      kms_request_str_destroy (request->service);
+      kms_request_str_destroy (request->access_key_id);
+      kms_request_str_destroy (request->secret_key);
+      kms_request_str_destroy (request->method);
+      kms_request_str_destroy (request->path);
+      kms_request_str_destroy (request->query);
+      kms_kv_list_destroy (request->query_params);
+   }
+
+   kms_sha256_ctx_destroy (request->creq_prefix);
+   kms_request_str_destroy (request->creq_suffix);
+   if (request->sorted_headers) {
+      kms_free (request->sorted_headers->kvs);
+      kms_free (request->sorted_headers);
+   }
+
+   kms_sha256_ctx_destroy (request->creq_hash);
+   kms_request_str_destroy (request->creq_buf);
+   kms_request_str_destroy (request->creq_path);
+   kms_signing_key_release (request->chunk_key);
+   kms_request_str_destroy (request->chunk_head);
    kms_request_str_destroy (request->payload);
-   kms_request_str_destroy (request->datetime);
-   kms_request_str_destroy (request->date);
-   kms_kv_list_destroy (request->query_params);
+   kms_free (request->borrowed);
+   kms_sha256_ctx_destroy (request->payload_hash_ctx);
+   kms_request_str_destroy (request->signed_head);
+   kms_request_str_cleanup (&request->datetime);
+   kms_request_str_cleanup (&request->date);
    kms_kv_list_destroy (request->header_fields);
-   free (request);
+   /* everything above that came from the arena goes at once */
+   kms_arena_destroy (request->arena);
+   kms_free (request);
+}
+
+static void
+clear_str (kms_request_str_t *str)
+{
+   kms_request_str_set_chars (str, "", 0);
+}
+
+bool
+kms_request_reset (kms_request_t *request,
+                   const char *method,
+                   const char *path_and_query,
+                   const kms_request_opt_t *opt)
+{
+   kms_arena_t *arena = request->arena;
+
+   if (arena) {
+      /* empty the arena, so memory the last use abandoned in it is reused.
+       * lists keep their index on the heap, free it first */
+      if (!request->tmpl) {
+         kms_kv_list_destroy (request->query_params);
+      }
+
+      kms_kv_list_destroy (request->header_fields);
+      kms_arena_rewind (arena, request->arena_start);
+      request->payload = kms_request_str_new_in (arena);
+      request->signed_head = kms_request_str_new_in (arena);
+      request->header_fields = kms_kv_list_new_in (arena);
+   }
+
+   if (request->tmpl || arena) {
+      /* stop borrowing, or the old fields went with the arena */
+      init_own_fields (request);
+      request->tmpl = NULL;
+   } else {
+      clear_str (request->region);
+      clear_str (request->service);
+      clear_str (request->access_key_id);
+      clear_str (request->secret_key);
+   }
+
+   request->error[0] = '\0';
+   request->failed = false;
+   request->finalized = false;
+   forget_signature (request);
+
+   kms_signing_key_release (request->chunk_key);
+   request->chunk_key = NULL;
+   request->chunked = false;
+   request->chunk_size = 0;
+   request->chunk_decoded_len = 0;
+   request->chunk_remaining = 0;
+   request->chunk_seeded = false;
+   request->chunk_done = false;
+
+   clear_str (request->payload);
+   request->borrowed_count = 0;
+   request->borrowed_len = 0;
+   if (request->payload_hash_ctx &&
+       !kms_sha256_ctx_reset (request->payload_hash_ctx)) {
+      kms_sha256_ctx_destroy (request->payload_hash_ctx);
+      request->payload_hash_ctx = NULL;
+   }
+
+   request->payload_hash_valid = false;
+   request->payload_hash_preset[0] = '\0';
+   request->content_sha256_header = false;
+   request->auto_content_length = true;
+
+   clear_str (request->signed_head);
+   clear_str (&request->datetime);
+   clear_str (&request->date);
+   request->auto_date = true;
+   kms_kv_list_clear (request->header_fields);
+
+   set_target (request, method, path_and_query);
+   apply_opt (request, opt);
+
+   return !request->failed;
 }
 
 const char *
@@ -127,13 +390,211 @@ kms_request_get_error (kms_request_t *request)
    return request->failed ? request->error : NULL;
 }
 
+/* add "key" with an empty value, and return the value to fill in. a cleared
+ * entry's strings are reused */
+static kms_request_str_t *
+add_header_value (kms_kv_list_t *lst, const char *key)
+{
+   kms_kv_list_add_chars (lst, key, strlen (key), "", 0);
+
+   return lst->kvs[lst->len - 1].value;
+}
+
+static void
+add_host_header (kms_kv_list_t *lst,
+                 kms_request_str_t *service,
+                 kms_request_str_t *region)
+{
+   kms_request_str_t *v = add_header_value (lst, "Host");
+
+   /* like "kms.us-east-1.amazonaws.com" */
+   kms_request_str_append (v, service);
+   kms_request_str_append_char (v, '.');
+   kms_request_str_append (v, region);
+   kms_request_str_append_chars (v, ".amazonaws.com", -1);
+}
+
+/* copy-on-write: before changing a field a template froze, take private
+ * copies of everything borrowed from it */
+static void
+unshare (kms_request_t *request)
+{
+   const kms_request_template_t *tmpl = request->tmpl;
+   kms_arena_t *arena = request->arena;
+   const kms_kv_t *kv;
+   size_t i;
+
+   if (!tmpl) {
+      return;
+   }
+
+   request->region = kms_request_str_dup_in (arena, tmpl->region);
+   request->service = kms_request_str_dup_in (arena, tmpl->service);
+   request->access_key_id = kms_request_str_dup_in (arena, tmpl->access_key_id);
+   request->secret_key = kms_request_str_dup_in (arena, tmpl->secret_key);
+   request->method = kms_request_str_dup_in (arena, tmpl->method);
+   request->path = kms_request_str_dup_in (arena, tmpl->path);
+   request->query = kms_request_str_dup_in (arena, tmpl->query);
+   request->query_params = kms_kv_list_dup_in (arena, tmpl->query_params);
+
+   for (i = 0; i < tmpl->header_fields->len; i++) {
+      kv = &tmpl->header_fields->kvs[i];
+      if (tmpl->auto_host && !request->finalized &&
+          kv->id == KMS_HEADER_HOST) {
+         /* finalize adds it again, in case region or service change */
+         continue;
+      }
+
+      kms_kv_list_add (request->header_fields, kv->key, kv->value);
+   }
+
+   request->tmpl = NULL;
+   forget_signature (request);
+}
+
+/* look in the request's own headers and those it borrows from its template */
+static const kms_kv_t *
+find_header (const kms_request_t *request, kms_header_id_t id)
+{
+   const kms_kv_t *kv = kms_kv_list_find_id (request->header_fields, id);
+
+   if (!kv && request->tmpl) {
+      kv = kms_kv_list_find_id (request->tmpl->header_fields, id);
+   }
+
+   return kv;
+}
+
 #define AMZ_DT_FORMAT "YYYYmmDDTHHMMSSZ"
 
+/* the current time, formatted, so requests made in the same second on a
+ * thread skip the formatting */
+static KMS_THREAD_LOCAL struct {
+   bool valid;
+   int64_t seconds;
+   char buf[sizeof AMZ_DT_FORMAT];
+} date_cache;
+
+static void
+put_digits (char *p, int64_t value, int width)
+{
+   while (width--) {
+      p[width] = (char) ('0' + value % 10);
+      value /= 10;
+   }
+}
+
+/* format like strftime's "%Y%m%dT%H%M%SZ" without going through struct tm */
+static bool
+format_epoch (int64_t seconds, char *buf)
+{
+   int64_t days, secs, era, doe, yoe, doy, mp, year, month, day;
+
+   /* floor division, for dates before 1970 */
+   days = seconds / 86400;
+   secs = seconds % 86400;
+   if (secs < 0) {
+      secs += 86400;
+      days--;
+   }
+
+   /* days to a civil date, from Howard Hinnant's "chrono-Compatible Low-Level
+    * Date Algorithms". eras are 400 years and start on March 1st */
+   days += 719468;
+   era = (days >= 0 ? days : days - 146096) / 146097;
+   doe = days - era * 146097;
+   yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+   doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+   mp = (5 * doy + 2) / 153;
+   day = doy - (153 * mp + 2) / 5 + 1;
+   month = mp < 10 ? mp + 3 : mp - 9;
+   year = yoe + era * 400 + (month <= 2);
+
+   if (year < 0 || year > 9999) {
+      return false;
+   }
+
+   put_digits (buf, year, 4);
+   put_digits (buf + 4, month, 2);
+   put_digits (buf + 6, day, 2);
+   buf[8] = 'T';
+   put_digits (buf + 9, secs / 3600, 2);
+   put_digits (buf + 11, secs / 60 % 60, 2);
+   put_digits (buf + 13, secs % 60, 2);
+   buf[15] = 'Z';
+   buf[16] = '\0';
+
+   return true;
+}
+
+/* "buf" is like "20150830T123600Z" */
+static void
+apply_date (kms_request_t *request, const char *buf)
+{
+   kms_kv_t *date_header;
+   kms_kv_t *kv;
+   size_t i;
+
+   request->auto_date = false;
+   kms_request_str_set_chars (&request->date, buf, sizeof "YYYYmmDD" - 1);
+   kms_request_str_set_chars (
+      &request->datetime, buf, sizeof AMZ_DT_FORMAT - 1);
+
+   date_header = NULL;
+   for (i = 0; i < request->header_fields->len; i++) {
+      kv = &request->header_fields->kvs[i];
+      if (kv->id == KMS_HEADER_X_AMZ_DATE &&
+          0 == strcmp (kv->key->str, "X-Amz-Date")) {
+         if (date_header) {
+            /* more than one */
+            date_header = NULL;
+            break;
+         }
+
+         date_header = kv;
+      }
+   }
+
+   if (date_header) {
+      /* update in place, the next signature only rehashes from the date on */
+      kms_request_str_set_chars (date_header->value, buf, -1);
+   } else {
+      kms_kv_list_del (request->header_fields, "X-Amz-Date");
+      kms_request_add_header_field (request, "X-Amz-Date", buf);
+   }
+}
+
+bool
+kms_request_set_date_epoch (kms_request_t *request, int64_t seconds)
+{
+   char buf[sizeof AMZ_DT_FORMAT];
+
+   if (request->failed) {
+      return false;
+   }
+
+   if (date_cache.valid && date_cache.seconds == seconds) {
+      apply_date (request, date_cache.buf);
+      return true;
+   }
+
+   if (!format_epoch (seconds, buf)) {
+      KMS_ERROR (request, "Invalid date: %lld seconds", (long long) seconds);
+      return false;
+   }
+
+   memcpy (date_cache.buf, buf, sizeof buf);
+   date_cache.seconds = seconds;
+   date_cache.valid = true;
+   apply_date (request, buf);
+
+   return true;
+}
+
 bool
 kms_request_set_date (kms_request_t *request, const struct tm *tm)
 {
    char buf[sizeof AMZ_DT_FORMAT];
-   struct tm tmp_tm;
 
    if (request->failed) {
       return false;
@@ -141,14 +602,7 @@ kms_request_set_date (kms_request_t *request, const struct tm *tm)
 
    if (!tm) {
       /* use current time */
-      time_t t;
-      time (&t);
-#ifdef _WIN32
-      gmtime_s (&tmp_tm, &t);
-#else
-      gmtime_r (&t, &tmp_tm);
-#endif
-      tm = &tmp_tm;
+      return kms_request_set_date_epoch (request, (int64_t) time (NULL));
    }
 
    if (0 == strftime (buf, sizeof AMZ_DT_FORMAT, "%Y%m%dT%H%M%SZ", tm)) {
@@ -156,19 +610,28 @@ kms_request_set_date (kms_request_t *request, const struct tm *tm)
       return false;
    }
 
-   kms_request_str_set_chars (request->date, buf, sizeof "YYYYmmDD" - 1);
-   kms_request_str_set_chars (request->datetime, buf, sizeof AMZ_DT_FORMAT - 1);
-   kms_kv_list_del (request->header_fields, "X-Amz-Date");
-   kms_request_add_header_field (request, "X-Amz-Date", buf);
+   apply_date (request, buf);
 
    return true;
 }
 
 #undef AMZ_DT_FORMAT
 
+/* the date is set when signing unless the caller set one */
+static bool
+stamp_date (kms_request_t *request)
+{
+   if (!request->auto_date) {
+      return true;
+   }
+
+   return kms_request_set_date (request, NULL);
+}
+
 bool
 kms_request_set_region (kms_request_t *request, const char *region)
 {
+   unshare (request);
    kms_request_str_set_chars (request->region, region, -1);
    return true;
 }
@@ -176,6 +639,7 @@ kms_request_set_region (kms_request_t *request, const char *region)
 bool
 kms_request_set_service (kms_request_t *request, const char *service)
 {
+   unshare (request);
    kms_request_str_set_chars (request->service, service, -1);
    return true;
 }
@@ -183,6 +647,7 @@ kms_request_set_service (kms_request_t *request, const char *service)
 bool
 kms_request_set_access_key_id (kms_request_t *request, const char *akid)
 {
+   unshare (request);
    kms_request_str_set_chars (request->access_key_id, akid, -1);
    return true;
 }
@@ -190,6 +655,7 @@ kms_request_set_access_key_id (kms_request_t *request, const char *akid)
 bool
 kms_request_set_secret_key (kms_request_t *request, const char *key)
 {
+   unshare (request);
    kms_request_str_set_chars (request->secret_key, key, -1);
    return true;
 }
@@ -199,15 +665,14 @@ kms_request_add_header_field (kms_request_t *request,
                               const char *field_name,
                               const char *value)
 {
-   kms_request_str_t *k, *v;
-
    CHECK_FAILED;
 
-   k = kms_request_str_new_from_chars (field_name, -1);
-   v = kms_request_str_new_from_chars (value, -1);
-   kms_kv_list_add (request->header_fields, k, v);
-   kms_request_str_destroy (k);
-   kms_request_str_destroy (v);
+   forget_signature (request);
+   kms_kv_list_add_chars (request->header_fields,
+                          field_name,
+                          strlen (field_name),
+                          value,
+                          strlen (value));
 
    return true;
 }
@@ -228,12 +693,43 @@ kms_request_append_header_field_value (kms_request_t *request,
          __FUNCTION__);
    }
 
+   forget_signature (request);
    v = request->header_fields->kvs[request->header_fields->len - 1].value;
    kms_request_str_append_chars (v, value, len);
 
    return true;
 }
 
+/* update the running hash of the payload, so signing does not need to walk
+ * the whole payload again */
+static bool
+hash_payload (kms_request_t *request, const char *payload, size_t len)
+{
+   /* the payload hash is at the end of the canonical request */
+   forget_signature (request);
+
+   if (request->payload_hash_preset[0]) {
+      /* the caller supplied the hash */
+      return true;
+   }
+
+   if (!request->payload_hash_ctx) {
+      request->payload_hash_ctx = kms_sha256_ctx_new ();
+      if (!request->payload_hash_ctx) {
+         KMS_ERROR (request, "Could not create SHA-256 context");
+         return false;
+      }
+   }
+
+   if (!kms_sha256_ctx_update (request->payload_hash_ctx, payload, len)) {
+      KMS_ERROR (request, "Could not hash payload");
+      return false;
+   }
+
+   request->payload_hash_valid = false;
+   return true;
+}
+
 bool
 kms_request_append_payload (kms_request_t *request,
                             const char *payload,
@@ -241,123 +737,423 @@ kms_request_append_payload (kms_request_t *request,
 {
    CHECK_FAILED;
 
+   if (request->borrowed_count) {
+      KMS_ERROR (request, "Cannot append a copied payload to a borrowed one");
+      return false;
+   }
+
+   if (request->chunked) {
+      KMS_ERROR (request, "Cannot append a payload to a chunked upload");
+      return false;
+   }
+
+   if (!hash_payload (request, payload, len)) {
+      return false;
+   }
+
    kms_request_str_append_chars (request->payload, payload, len);
 
    return true;
 }
 
-/* docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html
- *
- * "Sort the parameter names by character code point in ascending order. For
- * example, a parameter name that begins with the uppercase letter F precedes a
- * parameter name that begins with a lowercase letter b."
- */
-static int
-cmp_query_params (const void *a, const void *b)
+bool
+kms_request_append_payload_borrowed (kms_request_t *request,
+                                     const char *payload,
+                                     size_t len)
 {
-   int r = strcmp (((kms_kv_t *) a)->key->str, ((kms_kv_t *) b)->key->str);
-   if (r != 0) {
-      return r;
+   CHECK_FAILED;
+
+   if (request->payload->len) {
+      KMS_ERROR (request, "Cannot append a borrowed payload to a copied one");
+      return false;
    }
 
-   /* not in docs, but tested in get-vanilla-query-order-key: sort by value */
-   return strcmp (((kms_kv_t *) a)->value->str, ((kms_kv_t *) b)->value->str);
-}
+   if (request->chunked) {
+      KMS_ERROR (request, "Cannot append a payload to a chunked upload");
+      return false;
+   }
 
-static void
-append_canonical_query (kms_request_t *request, kms_request_str_t *str)
-{
-   size_t i;
-   kms_kv_list_t *lst;
+   if (!hash_payload (request, payload, len)) {
+      return false;
+   }
 
-   if (!request->query_params->len) {
-      return;
+   if (request->borrowed_count == request->borrowed_size) {
+      request->borrowed_size =
+         request->borrowed_size ? 2 * request->borrowed_size : 4;
+      request->borrowed =
+         kms_realloc (request->borrowed,
+                  request->borrowed_size * sizeof (kms_request_iovec_t));
    }
 
-   lst = kms_kv_list_dup (request->query_params);
-   kms_kv_list_sort (lst, cmp_query_params);
+   request->borrowed[request->borrowed_count].iov_base = payload;
+   request->borrowed[request->borrowed_count].iov_len = len;
+   request->borrowed_count++;
+   request->borrowed_len += len;
 
-   for (i = 0; i < lst->len; i++) {
-      kms_request_str_append_escaped (str, lst->kvs[i].key, true);
-      kms_request_str_append_char (str, '=');
-      kms_request_str_append_escaped (str, lst->kvs[i].value, true);
+   return true;
+}
 
-      if (i < lst->len - 1) {
-         kms_request_str_append_char (str, '&');
-      }
-   }
+static size_t
+payload_len (const kms_request_t *request)
+{
+   return request->payload->len + request->borrowed_len;
+}
 
-   kms_kv_list_destroy (lst);
+#define LITERAL_LEN(_lit) (sizeof (_lit) - 1)
+
+static char *
+put_chars (char *p, const char *chars, size_t len)
+{
+   memcpy (p, chars, len);
+   return p + len;
 }
 
-/* "lst" is a sorted list of headers */
-static void
-append_canonical_headers (kms_kv_list_t *lst, kms_request_str_t *str)
+#define PUT_LITERAL(_p, _lit) put_chars ((_p), (_lit), LITERAL_LEN (_lit))
+
+static char *
+put_str (char *p, const kms_request_str_t *str)
 {
-   size_t i;
-   kms_kv_t *kv;
-   const kms_request_str_t *previous_key = NULL;
+   return put_chars (p, str->str, str->len);
+}
 
-   /* aws docs: "To create the canonical headers list, convert all header names
-    * to lowercase and remove leading spaces and trailing spaces. Convert
-    * sequential spaces in the header value to a single space." "Do not sort the
-    * values in headers that have multiple values." */
+static char *
+put_hex (char *p, const unsigned char *data, size_t len)
+{
+   hexlify_into (p, data, len);
+
+   return p + 2 * len;
+}
+
+/* the signing state kept by the request, created on first use */
+static bool
+init_signing_state (kms_request_t *request)
+{
+   if (!request->creq_hash) {
+      request->creq_hash = kms_sha256_ctx_new ();
+   }
+
+   if (!request->creq_prefix) {
+      request->creq_prefix = kms_sha256_ctx_new ();
+   }
+
+   if (!request->creq_buf) {
+      request->creq_buf = kms_request_str_new ();
+      request->creq_suffix = kms_request_str_new ();
+      request->creq_path = kms_request_str_new ();
+   }
+
+   return request->creq_hash && request->creq_prefix;
+}
+
+/* SHA-256 of an empty payload */
+#define EMPTY_PAYLOAD_HASH \
+   "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/* the last line of the canonical request, which is also the value of
+ * x-amz-content-sha256: the hex payload hash or a literal like
+ * "UNSIGNED-PAYLOAD". "out" must have room for KMS_PAYLOAD_HASH_MAX bytes.
+ * uses creq_hash, call it before hashing the canonical request */
+static bool
+get_payload_hash (kms_request_t *request, char *out)
+{
+   if (request->payload_hash_preset[0]) {
+      /* set with kms_request_set_payload_hash and friends */
+      strcpy (out, request->payload_hash_preset);
+      return true;
+   }
+
+   if (!request->payload_hash_ctx) {
+      /* nothing appended */
+      strcpy (out, EMPTY_PAYLOAD_HASH);
+      return true;
+   }
+
+   if (!request->payload_hash_valid) {
+      /* finish a copy, so more can be appended to the payload later */
+      request->payload_hash_valid =
+         init_signing_state (request) &&
+         kms_sha256_ctx_copy (request->creq_hash, request->payload_hash_ctx) &&
+         kms_sha256_ctx_final (request->creq_hash, request->payload_hash);
+      if (!request->payload_hash_valid) {
+         return false;
+      }
+   }
+
+   *put_hex (out, request->payload_hash, sizeof (request->payload_hash)) = '\0';
+   return true;
+}
+
+bool
+kms_request_set_payload_hash (kms_request_t *request, const uint8_t *hash)
+{
+   CHECK_FAILED;
+
+   forget_signature (request);
+   *put_hex (request->payload_hash_preset, hash, 32) = '\0';
+   return true;
+}
+
+bool
+kms_request_set_payload_hash_hex (kms_request_t *request, const char *hex)
+{
+   size_t i;
+
+   CHECK_FAILED;
+
+   for (i = 0; i < 64; i++) {
+      if (!isxdigit ((unsigned char) hex[i])) {
+         break;
+      }
+   }
+
+   if (i != 64 || hex[64] != '\0') {
+      KMS_ERROR (request, "Payload hash must be 64 hex characters: %s", hex);
+      return false;
+   }
+
+   forget_signature (request);
+   for (i = 0; i < 64; i++) {
+      request->payload_hash_preset[i] = (char) tolower (hex[i]);
+   }
+
+   request->payload_hash_preset[64] = '\0';
+   return true;
+}
+
+bool
+kms_request_set_unsigned_payload (kms_request_t *request)
+{
+   CHECK_FAILED;
+
+   forget_signature (request);
+   strcpy (request->payload_hash_preset, "UNSIGNED-PAYLOAD");
+   return true;
+}
+
+/* docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html
+ *
+ * "Sort the parameter names by character code point in ascending order. For
+ * example, a parameter name that begins with the uppercase letter F precedes a
+ * parameter name that begins with a lowercase letter b."
+ */
+static int
+cmp_query_params (const void *a, const void *b)
+{
+   int r = strcmp (((kms_kv_t *) a)->key->str, ((kms_kv_t *) b)->key->str);
+   if (r != 0) {
+      return r;
+   }
+
+   /* not in docs, but tested in get-vanilla-query-order-key: sort by value */
+   return strcmp (((kms_kv_t *) a)->value->str, ((kms_kv_t *) b)->value->str);
+}
+
+/* the canonical request is either collected in "str", for
+ * kms_request_get_canonical, or fed to "hash" as it is generated. in the
+ * latter case "str" is a small buffer that is flushed whenever it fills up,
+ * so the canonical request is never held in memory in full. */
+typedef struct {
+   kms_request_str_t *str;
+   kms_sha256_ctx_t *hash;
+   bool failed;
+   /* if set, copy the hash state just before the X-Amz-Date value into
+    * "prefix", and collect everything hashed after the value in "suffix".
+    * "split" tells if that happened */
+   kms_sha256_ctx_t *prefix;
+   kms_request_str_t *suffix;
+   bool split;
+} canonical_sink_t;
+
+#define CANONICAL_FLUSH_SIZE 256
+
+static void
+sink_init (canonical_sink_t *sink,
+           kms_request_str_t *str,
+           kms_sha256_ctx_t *hash)
+{
+   sink->str = str;
+   sink->hash = hash;
+   sink->failed = false;
+   sink->prefix = NULL;
+   sink->suffix = NULL;
+   sink->split = false;
+}
+
+/* hash and discard buffered bytes once there are at least "min_len" */
+static void
+sink_flush (canonical_sink_t *sink, size_t min_len)
+{
+   if (!sink->hash || sink->failed || sink->str->len < min_len) {
+      return;
+   }
+
+   if (!kms_sha256_ctx_update (sink->hash, sink->str->str, sink->str->len)) {
+      sink->failed = true;
+   }
+
+   if (sink->split) {
+      kms_request_str_append (sink->suffix, sink->str);
+   }
+
+   sink->str->len = 0;
+   sink->str->str[0] = '\0';
+}
+
+static void
+append_canonical_query (kms_kv_list_t *query_params, canonical_sink_t *sink)
+{
+   const void *stack_ptrs[2 * KV_SORT_STACK];
+   const void **ptrs = stack_ptrs;
+   const kms_kv_t *kv;
+   size_t n = query_params->len;
+   size_t i;
+   kms_request_str_t *str = sink->str;
+
+   if (!n) {
+      return;
+   }
+
+   /* sort pointers to the params, not copies of them */
+   if (n > KV_SORT_STACK) {
+      ptrs = kms_malloc (2 * n * sizeof (void *));
+   }
+
+   kms_kv_list_sort_ptrs (query_params, ptrs, cmp_query_params);
+
+   for (i = 0; i < n; i++) {
+      kv = (const kms_kv_t *) ptrs[i];
+      kms_request_str_append_escaped (str, kv->key, true);
+      kms_request_str_append_char (str, '=');
+      kms_request_str_append_escaped (str, kv->value, true);
+
+      if (i < n - 1) {
+         kms_request_str_append_char (str, '&');
+      }
+
+      sink_flush (sink, CANONICAL_FLUSH_SIZE);
+   }
+
+   if (ptrs != stack_ptrs) {
+      kms_free ((void *) ptrs);
+   }
+}
+
+static bool
+is_connection_header (const kms_kv_t *kv)
+{
+   return kv->id == KMS_HEADER_CONNECTION;
+}
+
+/* "lst" is a sorted list of headers */
+static void
+append_canonical_headers (kms_kv_list_t *lst, canonical_sink_t *sink)
+{
+   size_t i;
+   kms_kv_t *kv;
+   const kms_kv_t *previous = NULL;
+   kms_request_str_t *str = sink->str;
+
+   /* aws docs: "To create the canonical headers list, convert all header names
+    * to lowercase and remove leading spaces and trailing spaces. Convert
+    * sequential spaces in the header value to a single space." "Do not sort the
+    * values in headers that have multiple values." */
    for (i = 0; i < lst->len; i++) {
       kv = &lst->kvs[i];
-      if (previous_key && 0 == strcasecmp (previous_key->str, kv->key->str)) {
+      if (is_connection_header (kv)) {
+         continue;
+      }
+
+      if (previous && kms_kv_same_key (previous, kv)) {
          /* duplicate header */
          kms_request_str_append_char (str, ',');
          kms_request_str_append_stripped (str, kv->value);
          continue;
       }
 
-      if (i > 0) {
+      if (previous) {
          kms_request_str_append_newline (str);
       }
 
-      kms_request_str_append_lowercase (str, kv->key);
+      sink_flush (sink, CANONICAL_FLUSH_SIZE);
+      kms_request_str_append (str, kv->lower);
       kms_request_str_append_char (str, ':');
-      kms_request_str_append_stripped (str, kv->value);
-      previous_key = kv->key;
+      if (sink->prefix && kv->id == KMS_HEADER_X_AMZ_DATE &&
+          (i + 1 == lst->len || lst->kvs[i + 1].id != KMS_HEADER_X_AMZ_DATE)) {
+         sink_flush (sink, 0);
+         if (!kms_sha256_ctx_copy (sink->prefix, sink->hash)) {
+            sink->failed = true;
+         }
+
+         kms_request_str_append_stripped (str, kv->value);
+         sink_flush (sink, 0);
+         clear_str (sink->suffix);
+         sink->split = true;
+      } else {
+         kms_request_str_append_stripped (str, kv->value);
+      }
+
+      previous = kv;
    }
 
    kms_request_str_append_newline (str);
 }
 
+/* is the i-th header of the sorted list "lst" in the SignedHeaders list? */
+static bool
+is_signed_header (kms_kv_list_t *lst, size_t i)
+{
+   if (is_connection_header (&lst->kvs[i])) {
+      return false;
+   }
+
+   /* duplicate header */
+   return i == 0 || !kms_kv_same_key (&lst->kvs[i - 1], &lst->kvs[i]);
+}
+
 static void
 append_signed_headers (kms_kv_list_t *lst, kms_request_str_t *str)
 {
    size_t i;
-
-   kms_kv_t *kv;
-   const kms_request_str_t *previous_key = NULL;
+   bool first = true;
 
    for (i = 0; i < lst->len; i++) {
-      kv = &lst->kvs[i];
-      if (previous_key && 0 == strcasecmp (previous_key->str, kv->key->str)) {
-         /* duplicate header */
+      if (!is_signed_header (lst, i)) {
          continue;
       }
 
-      if (0 == strcasecmp (kv->key->str, "connection")) {
-         continue;
+      if (!first) {
+         kms_request_str_append_char (str, ';');
       }
 
-      kms_request_str_append_lowercase (str, kv->key);
-      if (i < lst->len - 1) {
-         kms_request_str_append_char (str, ';');
+      kms_request_str_append (str, lst->kvs[i].lower);
+      first = false;
+   }
+}
+
+static size_t
+signed_headers_len (kms_kv_list_t *lst)
+{
+   size_t i;
+   size_t len = 0;
+   bool first = true;
+
+   for (i = 0; i < lst->len; i++) {
+      if (!is_signed_header (lst, i)) {
+         continue;
       }
 
-      previous_key = kv->key;
+      len += lst->kvs[i].key->len + (first ? 0 : 1);
+      first = false;
    }
+
+   return len;
 }
 
 static bool
 finalize (kms_request_t *request)
 {
    kms_kv_list_t *lst;
-   kms_request_str_t *k;
-   kms_request_str_t *v;
+   char payload_hash[KMS_PAYLOAD_HASH_MAX];
 
    if (request->failed) {
       return false;
@@ -367,30 +1163,37 @@ finalize (kms_request_t *request)
       return true;
    }
 
+   if (!stamp_date (request)) {
+      return false;
+   }
+
    request->finalized = true;
 
    lst = request->header_fields;
 
-   if (!kms_kv_list_find (lst, "Host")) {
-      /* like "kms.us-east-1.amazonaws.com" */
-      k = kms_request_str_new_from_chars ("Host", -1);
-      v = kms_request_str_dup (request->service);
-      kms_request_str_append_char (v, '.');
-      kms_request_str_append (v, request->region);
-      kms_request_str_append_chars (v, ".amazonaws.com", -1);
-      kms_kv_list_add (lst, k, v);
-      kms_request_str_destroy (k);
-      kms_request_str_destroy (v);
+   if (!find_header (request, KMS_HEADER_HOST)) {
+      add_host_header (lst, request->service, request->region);
+   }
+
+   if (!find_header (request, KMS_HEADER_CONTENT_LENGTH) &&
+       payload_len (request) && request->auto_content_length) {
+      kms_request_str_appendf (add_header_value (lst, "Content-Length"),
+                               "%zu",
+                               payload_len (request));
    }
 
-   if (!kms_kv_list_find (lst, "Content-Length") && request->payload->len &&
-       request->auto_content_length) {
-      k = kms_request_str_new_from_chars ("Content-Length", -1);
-      v = kms_request_str_new ();
-      kms_request_str_appendf (v, "%zu", request->payload->len);
-      kms_kv_list_add (lst, k, v);
-      kms_request_str_destroy (k);
-      kms_request_str_destroy (v);
+   if (request->content_sha256_header &&
+       !find_header (request, KMS_HEADER_X_AMZ_CONTENT_SHA256)) {
+      if (!get_payload_hash (request, payload_hash)) {
+         KMS_ERROR (request, "Could not hash payload");
+         return false;
+      }
+
+      kms_kv_list_add_chars (lst,
+                             "X-Amz-Content-Sha256",
+                             LITERAL_LEN ("X-Amz-Content-Sha256"),
+                             payload_hash,
+                             strlen (payload_hash));
    }
 
    return true;
@@ -405,129 +1208,403 @@ finalize (kms_request_t *request)
 static int
 cmp_header_field_names (const void *a, const void *b)
 {
-   return strcasecmp (((kms_kv_t *) a)->key->str, ((kms_kv_t *) b)->key->str);
+   return kms_kv_cmp_keys ((const kms_kv_t *) a, (const kms_kv_t *) b);
 }
 
+/* a list of "len" headers that borrows its keys and values from the request
+ * or its template. free it with headers_destroy */
 static kms_kv_list_t *
-canonical_headers (const kms_request_t *request)
-{
-   kms_kv_list_t *lst;
-
-   assert (request->finalized);
-   lst = kms_kv_list_dup (request->header_fields);
-   kms_kv_list_sort (lst, cmp_header_field_names);
-   kms_kv_list_del (lst, "Connection");
-   return lst;
-}
-
-char *
-kms_request_get_canonical (kms_request_t *request)
+headers_new (size_t len)
 {
-   kms_request_str_t *canonical;
-   kms_request_str_t *normalized;
-   kms_kv_list_t *lst;
+   kms_kv_list_t *lst = kms_malloc (sizeof (kms_kv_list_t));
 
-   if (request->failed) {
+   if (!lst) {
       return NULL;
    }
 
-   if (!finalize (request)) {
+   lst->size = lst->len = lst->kept = len;
+   lst->kvs = kms_malloc ((len ? len : 1) * sizeof (kms_kv_t));
+   if (!lst->kvs) {
+      kms_free (lst);
       return NULL;
    }
 
-   canonical = kms_request_str_new ();
-   kms_request_str_append (canonical, request->method);
-   kms_request_str_append_newline (canonical);
-   normalized = kms_request_str_path_normalized (request->path);
-   kms_request_str_append_escaped (canonical, normalized, false);
-   kms_request_str_append_newline (canonical);
-   append_canonical_query (request, canonical);
-   kms_request_str_append_newline (canonical);
-   lst = canonical_headers (request);
-   append_canonical_headers (lst, canonical);
-   kms_request_str_append_newline (canonical);
-   append_signed_headers (lst, canonical);
-   kms_request_str_append_newline (canonical);
-   kms_request_str_append_hashed (canonical, request->payload);
+   lst->index = NULL;
+   lst->index_size = 0;
+   lst->arena = NULL;
 
-   kms_request_str_destroy (normalized);
-   kms_kv_list_destroy (lst);
+   return lst;
+}
 
-   return kms_request_str_detach (canonical);
+static void
+headers_destroy (kms_kv_list_t *lst)
+{
+   kms_free (lst->kvs);
+   kms_free (lst);
 }
 
-char *
-kms_request_get_string_to_sign (kms_request_t *request)
+/* borrows the same keys and values as "lst" */
+static kms_kv_list_t *
+headers_copy (const kms_kv_list_t *lst)
 {
-   bool success = false;
-   kms_request_str_t *sts;
-   kms_request_str_t *creq = NULL; /* canonical request */
+   kms_kv_list_t *copy = headers_new (lst->len);
 
-   if (request->failed) {
-      return NULL;
+   if (copy) {
+      memcpy (copy->kvs, lst->kvs, lst->len * sizeof (kms_kv_t));
    }
 
-   if (!finalize (request)) {
-      return NULL;
+   return copy;
+}
+
+/* the headers sorted once per signature, including "Connection", which the
+ * canonical request skips but the signed request includes. the template's
+ * headers are already sorted, only the request's own are sorted and merged
+ * in. the list's storage is kept between signatures */
+static void
+sort_headers (kms_request_t *request)
+{
+   const kms_kv_list_t *own = request->header_fields;
+   const kms_kv_list_t *frozen = NULL;
+   kms_kv_list_t *lst = request->sorted_headers;
+   kms_kv_list_t tail;
+   size_t len = own->len;
+   size_t i = 0, j = 0, n = 0;
+
+   if (request->tmpl) {
+      frozen = request->tmpl->header_fields;
+      len += frozen->len;
    }
 
-   sts = kms_request_str_new ();
-   kms_request_str_append_chars (sts, "AWS4-HMAC-SHA256\n", -1);
-   kms_request_str_append (sts, request->datetime);
-   kms_request_str_append_newline (sts);
+   if (!lst) {
+      lst = request->sorted_headers = headers_new (len);
+   } else if (lst->size < len) {
+      lst->kvs = kms_realloc (lst->kvs, len * sizeof (kms_kv_t));
+      lst->size = len;
+   }
 
-   /* credential scope, like "20150830/us-east-1/service/aws4_request" */
-   kms_request_str_append (sts, request->date);
-   kms_request_str_append_char (sts, '/');
-   kms_request_str_append (sts, request->region);
-   kms_request_str_append_char (sts, '/');
-   kms_request_str_append (sts, request->service);
-   kms_request_str_append_chars (sts, "/aws4_request\n", -1);
+   lst->len = lst->kept = len;
 
-   creq = kms_request_str_wrap (kms_request_get_canonical (request), -1);
-   if (!kms_request_str_append_hashed (sts, creq)) {
-      goto done;
+   /* sort the request's own headers at the end of the list */
+   tail = *lst;
+   tail.kvs = lst->kvs + (len - own->len);
+   tail.len = tail.kept = tail.size = own->len;
+   memcpy (tail.kvs, own->kvs, own->len * sizeof (kms_kv_t));
+   kms_kv_list_sort (&tail, cmp_header_field_names);
+
+   if (!frozen) {
+      return;
    }
 
-   success = true;
-done:
-   kms_request_str_destroy (creq);
-   if (!success) {
-      kms_request_str_destroy (sts);
-      sts = NULL;
+   /* stable merge from the front, the template's headers come first among
+    * equal names. an entry of the tail is read before it is overwritten */
+   while (i < frozen->len || j < own->len) {
+      if (j == own->len ||
+          (i < frozen->len &&
+           cmp_header_field_names (&frozen->kvs[i], &tail.kvs[j]) <= 0)) {
+         lst->kvs[n++] = frozen->kvs[i++];
+      } else {
+         lst->kvs[n++] = tail.kvs[j++];
+      }
+   }
+}
+
+/* the headers in canonical order. owned by the request until its headers
+ * change, don't modify or free them */
+static kms_kv_list_t *
+canonical_headers (kms_request_t *request)
+{
+   assert (request->finalized);
+
+   /* sorted already, unless headers changed since the last signature. the
+    * value of X-Amz-Date may have changed in place */
+   if (!request->headers_sorted) {
+      sort_headers (request);
+      request->headers_sorted = true;
    }
 
-   return kms_request_str_detach (sts);
+   return request->sorted_headers;
 }
 
-static bool
-kms_request_hmac (unsigned char *out,
-                  kms_request_str_t *key,
-                  kms_request_str_t *data)
+/* the normalized, escaped path of the canonical request. "normalized" is
+ * scratch space */
+static void
+append_canonical_path (kms_request_str_t *str,
+                       kms_request_str_t *path,
+                       kms_request_str_t *normalized)
 {
-   return kms_sha256_hmac (key->str, (int) key->len, data->str, data->len, out);
+   kms_request_str_set_path_normalized (normalized, path);
+   kms_request_str_append_escaped (str, normalized, false);
 }
 
-static bool
-kms_request_hmac_again (unsigned char *out,
-                        unsigned char *in,
-                        kms_request_str_t *data)
+/* like "POST\n/path\nquery=value\n", the part of the canonical request
+ * before the headers */
+static void
+append_canonical_prefix (kms_request_str_t *method,
+                         kms_request_str_t *path,
+                         kms_kv_list_t *query_params,
+                         kms_request_str_t *normalized,
+                         canonical_sink_t *sink)
 {
-   return kms_sha256_hmac ((const char *) in, 32, data->str, data->len, out);
+   kms_request_str_t *str = sink->str;
+
+   kms_request_str_append (str, method);
+   kms_request_str_append_newline (str);
+   append_canonical_path (str, path, normalized);
+   kms_request_str_append_newline (str);
+   sink_flush (sink, CANONICAL_FLUSH_SIZE);
+   append_canonical_query (query_params, sink);
+   kms_request_str_append_newline (str);
 }
 
-bool
-kms_request_get_signing_key (kms_request_t *request, unsigned char *key)
+/* the canonical request after append_canonical_prefix. "payload_hash" is
+ * from get_payload_hash */
+static void
+append_canonical_tail (kms_kv_list_t *lst,
+                       const char *payload_hash,
+                       canonical_sink_t *sink)
 {
-   bool success = false;
-   kms_request_str_t *aws4_plus_secret = NULL;
-   kms_request_str_t *aws4_request = NULL;
-   unsigned char k_date[32];
-   unsigned char k_region[32];
-   unsigned char k_service[32];
+   kms_request_str_t *str = sink->str;
 
-   if (request->failed) {
-      return false;
+   append_canonical_headers (lst, sink);
+   kms_request_str_append_newline (str);
+   append_signed_headers (lst, str);
+   kms_request_str_append_newline (str);
+   kms_request_str_append_chars (str, payload_hash, -1);
+}
+
+/* call init_signing_state first */
+static void
+append_canonical_request (kms_request_t *request,
+                          kms_kv_list_t *lst,
+                          const char *payload_hash,
+                          canonical_sink_t *sink)
+{
+   if (request->tmpl) {
+      kms_request_str_append (sink->str, request->tmpl->canonical_prefix);
+   } else {
+      append_canonical_prefix (request->method,
+                               request->path,
+                               request->query_params,
+                               request->creq_path,
+                               sink);
+   }
+
+   append_canonical_tail (lst, payload_hash, sink);
+}
+
+/* SHA-256 of the canonical request, without materializing it. if only the
+ * date changed since the last time, resume from the saved state instead */
+static bool
+hash_canonical_request (kms_request_t *request,
+                        kms_kv_list_t *lst,
+                        unsigned char *hash)
+{
+   canonical_sink_t sink;
+   char payload_hash[KMS_PAYLOAD_HASH_MAX];
+
+   if (!init_signing_state (request)) {
+      return false;
+   }
+
+   if (request->creq_saved) {
+      return kms_sha256_ctx_copy (request->creq_hash, request->creq_prefix) &&
+             kms_sha256_ctx_update (request->creq_hash,
+                                    request->datetime.str,
+                                    request->datetime.len) &&
+             kms_sha256_ctx_update (request->creq_hash,
+                                    request->creq_suffix->str,
+                                    request->creq_suffix->len) &&
+             kms_sha256_ctx_final (request->creq_hash, hash);
+   }
+
+   /* the payload was hashed as it was appended */
+   if (!get_payload_hash (request, payload_hash) ||
+       !kms_sha256_ctx_reset (request->creq_hash)) {
+      return false;
+   }
+
+   clear_str (request->creq_buf);
+   sink_init (&sink, request->creq_buf, request->creq_hash);
+   /* for the next signature, if only the date changes */
+   sink.prefix = request->creq_prefix;
+   sink.suffix = request->creq_suffix;
+   append_canonical_request (request, lst, payload_hash, &sink);
+   sink_flush (&sink, 0);
+
+   if (sink.failed || !kms_sha256_ctx_final (request->creq_hash, hash)) {
+      return false;
+   }
+
+   request->creq_saved = sink.split;
+   return true;
+}
+
+/* the whole canonical request, or NULL */
+static kms_request_str_t *
+canonical_request (kms_request_t *request, kms_kv_list_t *lst)
+{
+   canonical_sink_t sink;
+   char payload_hash[KMS_PAYLOAD_HASH_MAX];
+
+   if (!init_signing_state (request) ||
+       !get_payload_hash (request, payload_hash)) {
+      return NULL;
+   }
+
+   sink_init (&sink, kms_request_str_new (), NULL);
+   append_canonical_request (request, lst, payload_hash, &sink);
+
+   return sink.str;
+}
+
+char *
+kms_request_get_canonical (kms_request_t *request)
+{
+   kms_request_str_t *creq;
+   kms_kv_list_t *lst;
+
+   if (request->failed) {
+      return NULL;
+   }
+
+   if (!finalize (request)) {
+      return NULL;
+   }
+
+   lst = canonical_headers (request);
+   creq = canonical_request (request, lst);
+
+   return creq ? kms_request_str_detach (creq) : NULL;
+}
+
+#define STS_ALGORITHM "AWS4-HMAC-SHA256\n"
+#define STS_SCOPE_END "/aws4_request\n"
+/* region and service names are short, a longer string to sign is
+ * allocated */
+#define STS_STACK 256
+
+static size_t
+string_to_sign_len (const kms_request_t *request)
+{
+   return LITERAL_LEN (STS_ALGORITHM) + request->datetime.len + 1 +
+          request->date.len + 1 + request->region->len + 1 +
+          request->service->len + LITERAL_LEN (STS_SCOPE_END) + 2 * 32;
+}
+
+/* write the string to sign into "buf", which must have room for
+ * string_to_sign_len bytes. "creq_hash" is the hash of the canonical
+ * request */
+static void
+put_string_to_sign (const kms_request_t *request,
+                    const unsigned char *creq_hash,
+                    char *buf)
+{
+   char *p = buf;
+
+   p = PUT_LITERAL (p, STS_ALGORITHM);
+   p = put_str (p, &request->datetime);
+   *p++ = '\n';
+
+   /* credential scope, like "20150830/us-east-1/service/aws4_request" */
+   p = put_str (p, &request->date);
+   *p++ = '/';
+   p = put_str (p, request->region);
+   *p++ = '/';
+   p = put_str (p, request->service);
+   p = PUT_LITERAL (p, STS_SCOPE_END);
+   p = put_hex (p, creq_hash, 32);
+
+   assert ((size_t) (p - buf) == string_to_sign_len (request));
+}
+
+static kms_request_str_t *
+string_to_sign_hashed (kms_request_t *request, const unsigned char *creq_hash)
+{
+   kms_request_str_t *sts = kms_request_str_new ();
+   size_t len = string_to_sign_len (request);
+
+   kms_request_str_reserve (sts, len);
+   put_string_to_sign (request, creq_hash, sts->str);
+   sts->len = len;
+   sts->str[len] = '\0';
+
+   return sts;
+}
+
+static kms_request_str_t *
+string_to_sign (kms_request_t *request, kms_kv_list_t *lst)
+{
+   unsigned char creq_hash[32];
+
+   if (!hash_canonical_request (request, lst, creq_hash)) {
+      return NULL;
+   }
+
+   return string_to_sign_hashed (request, creq_hash);
+}
+
+char *
+kms_request_get_string_to_sign (kms_request_t *request)
+{
+   kms_request_str_t *sts;
+   kms_kv_list_t *lst;
+
+   if (request->failed) {
+      return NULL;
+   }
+
+   if (!finalize (request)) {
+      return NULL;
+   }
+
+   lst = canonical_headers (request);
+   sts = string_to_sign (request, lst);
+
+   return sts ? kms_request_str_detach (sts) : NULL;
+}
+
+static bool
+kms_request_hmac (unsigned char *out,
+                  kms_request_str_t *key,
+                  kms_request_str_t *data)
+{
+   return kms_sha256_hmac (key->str, (int) key->len, data->str, data->len, out);
+}
+
+static bool
+kms_request_hmac_again (unsigned char *out,
+                        unsigned char *in,
+                        kms_request_str_t *data)
+{
+   return kms_sha256_hmac ((const char *) in, 32, data->str, data->len, out);
+}
+
+/* returns a reference to release with kms_signing_key_release, or NULL */
+static kms_signing_key_t *
+get_signing_key (kms_request_t *request)
+{
+   kms_signing_key_t *signing_key = NULL;
+   kms_request_str_t *aws4_plus_secret = NULL;
+   kms_request_str_t *aws4_request = NULL;
+   unsigned char k_date[32];
+   unsigned char k_region[32];
+   unsigned char k_service[32];
+   unsigned char key[32];
+   unsigned char cache_id[KMS_SIGNING_KEY_CACHE_ID_LEN];
+
+   /* the signing key only changes once per UTC day per (secret, region,
+    * service), skip the four HMACs below if we derived it before */
+   if (!kms_signing_key_cache_id (request->secret_key,
+                                  &request->date,
+                                  request->region,
+                                  request->service,
+                                  cache_id)) {
+      return NULL;
+   }
+
+   signing_key = kms_signing_key_cache_get (cache_id);
+   if (signing_key) {
+      return signing_key;
    }
 
    /* docs.aws.amazon.com/general/latest/gr/sigv4-calculate-signature.html
@@ -544,75 +1621,168 @@ kms_request_get_signing_key (kms_request_t *request, unsigned char *key)
 
    aws4_request = kms_request_str_new_from_chars ("aws4_request", -1);
 
-   if (!(kms_request_hmac (k_date, aws4_plus_secret, request->date) &&
+   if (!(kms_request_hmac (k_date, aws4_plus_secret, &request->date) &&
          kms_request_hmac_again (k_region, k_date, request->region) &&
          kms_request_hmac_again (k_service, k_region, request->service) &&
          kms_request_hmac_again (key, k_service, aws4_request))) {
       goto done;
    }
 
-   success = true;
+   signing_key = kms_signing_key_cache_put (cache_id, &request->date, key);
 done:
    kms_request_str_destroy (aws4_plus_secret);
    kms_request_str_destroy (aws4_request);
 
-   return success;
+   return signing_key;
 }
 
-char *
-kms_request_get_signature (kms_request_t *request)
+bool
+kms_request_get_signing_key (kms_request_t *request, unsigned char *key)
+{
+   kms_signing_key_t *signing_key;
+
+   if (request->failed || !stamp_date (request)) {
+      return false;
+   }
+
+   signing_key = get_signing_key (request);
+   if (!signing_key) {
+      return false;
+   }
+
+   memcpy (key, signing_key->key, sizeof (signing_key->key));
+   kms_signing_key_release (signing_key);
+
+   return true;
+}
+
+#define AUTHZ_CREDENTIAL "AWS4-HMAC-SHA256 Credential="
+#define AUTHZ_SIGNED_HEADERS "/aws4_request, SignedHeaders="
+#define AUTHZ_SIGNATURE ", Signature="
+
+/* sign the canonical request with hash "creq_hash". "shared_key" is the
+ * request's signing key if the caller already has it, or NULL to look it up */
+static bool
+sign_hashed (kms_request_t *request,
+             const unsigned char *creq_hash,
+             kms_signing_key_t *shared_key,
+             unsigned char *signature)
 {
    bool success = false;
-   kms_kv_list_t *lst = NULL;
-   kms_request_str_t *sig = NULL;
-   kms_request_str_t *sts = NULL;
-   unsigned char signing_key[32];
-   unsigned char signature[32];
+   char stack_sts[STS_STACK];
+   char *sts = stack_sts;
+   size_t sts_len = string_to_sign_len (request);
+   kms_signing_key_t *signing_key = NULL;
+
+   if (sts_len > sizeof (stack_sts)) {
+      sts = kms_malloc (sts_len);
+      if (!sts) {
+         return false;
+      }
+   }
 
-   if (request->failed) {
-      return NULL;
+   put_string_to_sign (request, creq_hash, sts);
+
+   if (!shared_key) {
+      signing_key = get_signing_key (request);
+      shared_key = signing_key;
    }
 
-   sts = kms_request_str_wrap (kms_request_get_string_to_sign (request), -1);
-   if (!sts) {
+   /* the cached key's HMAC midstates are already computed */
+   if (!(shared_key && kms_sha256_hmac_compute (
+                          shared_key->hmac, sts, sts_len, signature))) {
       goto done;
    }
 
+   if (request->chunked) {
+      /* the seed of the chunk signature chain, start over. the chunks are
+       * signed with the seed's key, the date or credentials may have
+       * changed since the last seed */
+      kms_signing_key_release (request->chunk_key);
+      request->chunk_key = signing_key;
+      signing_key = NULL;
+      memcpy (request->chunk_signature, signature, 32);
+      request->chunk_remaining = request->chunk_decoded_len;
+      request->chunk_seeded = true;
+      request->chunk_done = false;
+   }
+
+   success = true;
+done:
+   kms_signing_key_release (signing_key);
+   if (sts != stack_sts) {
+      kms_free (sts);
+   }
+
+   return success;
+}
+
+static bool
+compute_signature (kms_request_t *request,
+                   kms_kv_list_t *lst,
+                   unsigned char *signature)
+{
+   unsigned char creq_hash[32];
+
+   return hash_canonical_request (request, lst, creq_hash) &&
+          sign_hashed (request, creq_hash, NULL, signature);
+}
+
+/* the Authorization header value, "lst" is from canonical_headers */
+static kms_request_str_t *
+authorization (kms_request_t *request, kms_kv_list_t *lst)
+{
+   kms_request_str_t *sig = NULL;
+   unsigned char signature[32];
+
+   if (!compute_signature (request, lst, signature)) {
+      return NULL;
+   }
+
    sig = kms_request_str_new ();
-   kms_request_str_append_chars (sig, "AWS4-HMAC-SHA256 Credential=", -1);
+   kms_request_str_append_chars (sig, AUTHZ_CREDENTIAL, -1);
    kms_request_str_append (sig, request->access_key_id);
    kms_request_str_append_char (sig, '/');
-   kms_request_str_append (sig, request->date);
+   kms_request_str_append (sig, &request->date);
    kms_request_str_append_char (sig, '/');
    kms_request_str_append (sig, request->region);
    kms_request_str_append_char (sig, '/');
    kms_request_str_append (sig, request->service);
-   kms_request_str_append_chars (sig, "/aws4_request, SignedHeaders=", -1);
-   lst = canonical_headers (request);
+   kms_request_str_append_chars (sig, AUTHZ_SIGNED_HEADERS, -1);
    append_signed_headers (lst, sig);
-   kms_request_str_append_chars (sig, ", Signature=", -1);
-   if (!(kms_request_get_signing_key (request, signing_key) &&
-         kms_request_hmac_again (signature, signing_key, sts))) {
-      goto done;
-   }
-
+   kms_request_str_append_chars (sig, AUTHZ_SIGNATURE, -1);
    kms_request_str_append_hex (sig, signature, sizeof (signature));
-   success = true;
-done:
-   kms_kv_list_destroy (lst);
-   kms_request_str_destroy (sts);
 
-   if (!success) {
-      kms_request_str_destroy (sig);
-      sig = NULL;
+   return sig;
+}
+
+char *
+kms_request_get_signature (kms_request_t *request)
+{
+   kms_kv_list_t *lst;
+   kms_request_str_t *sig;
+
+   if (request->failed) {
+      return NULL;
+   }
+
+   if (!finalize (request)) {
+      return NULL;
    }
 
-   return kms_request_str_detach (sig);
+   lst = canonical_headers (request);
+   sig = authorization (request, lst);
+
+   return sig ? kms_request_str_detach (sig) : NULL;
 }
 
 void
 kms_request_validate (kms_request_t *request) 
 {
+   if (!stamp_date (request)) {
+      return;
+   }
+
    if (0 == request->region->len) {
       KMS_ERROR (request, "Region not set");
    } else if (0 == request->service->len) {
@@ -623,85 +1793,929 @@ kms_request_validate (kms_request_t *request)
       KMS_ERROR (request, "Method not set");
    } else if (0 == request->path->len) {
       KMS_ERROR (request, "Path not set");
-   } else if (0 == request->date->len) {
+   } else if (0 == request->date.len) {
       KMS_ERROR (request, "Date not set");
    } else if (0 == request->secret_key->len) {
       KMS_ERROR (request, "Secret key not set");
    }
 }
 
-char *
-kms_request_get_signed (kms_request_t *request)
+/* exact length of the signed request up to the payload, including the blank
+ * line before it. "lst" is from canonical_headers */
+static size_t
+signed_head_len (kms_request_t *request, kms_kv_list_t *lst)
 {
-   bool success = false;
-   kms_kv_list_t *lst = NULL;
-   char *signature = NULL;
-   kms_request_str_t *sreq = NULL;
+   size_t len;
    size_t i;
 
-   kms_request_validate (request);
-   if (request->failed) {
-      return NULL;
+   /* like "POST / HTTP/1.1\n" */
+   len = request->method->len + 1 + request->path->len;
+   if (request->query->len) {
+      len += 1 + request->query->len;
    }
 
-   if (!finalize (request)) {
-      return NULL;
+   len += LITERAL_LEN (" HTTP/1.1\n");
+
+   for (i = 0; i < lst->len; i++) {
+      len += lst->kvs[i].key->len + 1 + lst->kvs[i].value->len + 1;
+   }
+
+   len += LITERAL_LEN ("Authorization: ") + LITERAL_LEN (AUTHZ_CREDENTIAL) +
+          request->access_key_id->len + 1 + request->date.len + 1 +
+          request->region->len + 1 + request->service->len +
+          LITERAL_LEN (AUTHZ_SIGNED_HEADERS) + signed_headers_len (lst) +
+          LITERAL_LEN (AUTHZ_SIGNATURE) + 2 * 32;
+
+   if (payload_len (request) || request->chunked) {
+      len += 2;
+   }
+
+   return len;
+}
+
+static size_t
+signed_len (kms_request_t *request, kms_kv_list_t *lst)
+{
+   return signed_head_len (request, lst) + payload_len (request);
+}
+
+static char *
+put_signed_headers (char *p, kms_kv_list_t *lst)
+{
+   size_t i;
+   bool first = true;
+
+   for (i = 0; i < lst->len; i++) {
+      if (!is_signed_header (lst, i)) {
+         continue;
+      }
+
+      if (!first) {
+         *p++ = ';';
+      }
+
+      memcpy (p, lst->kvs[i].lower->str, lst->kvs[i].lower->len);
+      p += lst->kvs[i].lower->len;
+      first = false;
    }
 
-   sreq = kms_request_str_new ();
+   return p;
+}
+
+/* write the signed request up to the payload into "buf", which must have
+ * room for signed_head_len bytes */
+static void
+write_signed_head (kms_request_t *request,
+                   kms_kv_list_t *lst,
+                   const unsigned char *signature,
+                   char *buf)
+{
+   char *p = buf;
+   size_t i;
+
    /* like "POST / HTTP/1.1" */
-   kms_request_str_append (sreq, request->method);
-   kms_request_str_append_char (sreq, ' ');
-   kms_request_str_append (sreq, request->path);
+   p = put_str (p, request->method);
+   *p++ = ' ';
+   p = put_str (p, request->path);
    if (request->query->len) {
-      kms_request_str_append_char (sreq, '?');
-      kms_request_str_append (sreq, request->query);
+      *p++ = '?';
+      p = put_str (p, request->query);
    }
 
-   kms_request_str_append_chars (sreq, " HTTP/1.1", -1);
-   kms_request_str_append_newline (sreq);
+   p = PUT_LITERAL (p, " HTTP/1.1\n");
 
    /* headers */
-   lst = kms_kv_list_dup (request->header_fields);
-   kms_kv_list_sort (lst, cmp_header_field_names);
    for (i = 0; i < lst->len; i++) {
-      kms_request_str_append (sreq, lst->kvs[i].key);
-      kms_request_str_append_char (sreq, ':');
-      kms_request_str_append (sreq, lst->kvs[i].value);
-      kms_request_str_append_newline (sreq);
+      p = put_str (p, lst->kvs[i].key);
+      *p++ = ':';
+      p = put_str (p, lst->kvs[i].value);
+      *p++ = '\n';
    }
 
-   /* authorization header */
-   signature = kms_request_get_signature (request);
-   if (!signature) {
-      goto done;
+   /* authorization header, note space after ':', to match test .sreq files */
+   p = PUT_LITERAL (p, "Authorization: " AUTHZ_CREDENTIAL);
+   p = put_str (p, request->access_key_id);
+   *p++ = '/';
+   p = put_str (p, &request->date);
+   *p++ = '/';
+   p = put_str (p, request->region);
+   *p++ = '/';
+   p = put_str (p, request->service);
+   p = PUT_LITERAL (p, AUTHZ_SIGNED_HEADERS);
+   p = put_signed_headers (p, lst);
+   p = PUT_LITERAL (p, AUTHZ_SIGNATURE);
+   p = put_hex (p, signature, 32);
+
+   if (payload_len (request) || request->chunked) {
+      p = PUT_LITERAL (p, "\n\n");
    }
 
-   /* note space after ':', to match test .sreq files */
-   kms_request_str_append_chars (sreq, "Authorization: ", -1);
-   kms_request_str_append_chars (sreq, signature, -1);
+   assert ((size_t) (p - buf) == signed_head_len (request, lst));
+}
+
+/* write the whole signed request into "buf", which must have room for
+ * signed_len bytes */
+static void
+write_signed (kms_request_t *request,
+              kms_kv_list_t *lst,
+              const unsigned char *signature,
+              char *buf)
+{
+   char *p;
+   size_t i;
+
+   write_signed_head (request, lst, signature, buf);
 
    /* body */
-   if (request->payload->len) {
-      kms_request_str_append_newline (sreq);
-      kms_request_str_append_newline (sreq);
-      kms_request_str_append (sreq, request->payload);
+   p = put_str (buf + signed_head_len (request, lst), request->payload);
+   for (i = 0; i < request->borrowed_count; i++) {
+      p = put_chars (p,
+                     (const char *) request->borrowed[i].iov_base,
+                     request->borrowed[i].iov_len);
    }
+}
 
-   success = true;
-done:
-   free (signature);
-   kms_kv_list_destroy (lst);
+/* validate and finalize, then sort the headers */
+static kms_kv_list_t *
+prepare_signed (kms_request_t *request)
+{
+   kms_request_validate (request);
+   if (request->failed) {
+      return NULL;
+   }
+
+   if (!finalize (request)) {
+      return NULL;
+   }
+
+   return canonical_headers (request);
+}
 
-   if (!success) {
-      kms_request_str_destroy (sreq);
-      sreq = NULL;
+char *
+kms_request_get_signed (kms_request_t *request)
+{
+   kms_kv_list_t *lst;
+   unsigned char signature[32];
+   char *sreq = NULL;
+   size_t len;
+
+   lst = prepare_signed (request);
+   if (!lst) {
+      return NULL;
+   }
+
+   if (compute_signature (request, lst, signature)) {
+      /* the length is known up front, allocate once instead of growing */
+      len = signed_len (request, lst);
+      sreq = kms_malloc (len + 1);
+      if (!sreq) {
+         KMS_ERROR (request, "Could not allocate %zu bytes", len + 1);
+         return NULL;
+      }
+
+      write_signed (request, lst, signature, sreq);
+      sreq[len] = '\0';
+   }
+
+   return sreq;
+}
+
+size_t
+kms_request_get_signed_len (kms_request_t *request)
+{
+   kms_kv_list_t *lst;
+
+   lst = prepare_signed (request);
+   if (!lst) {
+      return 0;
+   }
+
+   return signed_len (request, lst);
+}
+
+size_t
+kms_request_write_signed (kms_request_t *request, char *buf, size_t size)
+{
+   kms_kv_list_t *lst;
+   unsigned char signature[32];
+   size_t len;
+
+   lst = prepare_signed (request);
+   if (!lst) {
+      return 0;
+   }
+
+   len = signed_len (request, lst);
+   if (len > size) {
+      /* not an error in the request, the caller may retry with a bigger
+       * buffer */
+      len = 0;
+   } else if (compute_signature (request, lst, signature)) {
+      write_signed (request, lst, signature, buf);
+   } else {
+      len = 0;
+   }
+
+   return len;
+}
+
+size_t
+kms_request_get_signed_iov (kms_request_t *request,
+                            kms_request_iovec_t *iov,
+                            size_t iov_max)
+{
+   kms_kv_list_t *lst;
+   unsigned char signature[32];
+   kms_request_str_t *head = request->signed_head;
+   size_t head_len;
+   size_t iov_count;
+   size_t i;
+
+   lst = prepare_signed (request);
+   if (!lst) {
+      return 0;
+   }
+
+   iov_count = 1 + (request->payload->len ? 1 : 0) + request->borrowed_count;
+   if (iov_max < iov_count) {
+      /* tell the caller how many segments to make room for */
+      goto done;
+   }
+
+   /* the head buffer is owned by the request and reused by later calls */
+   head_len = signed_head_len (request, lst);
+   head->len = 0;
+   kms_request_str_reserve (head, head_len);
+   if (!compute_signature (request, lst, signature)) {
+      iov_count = 0;
+      goto done;
+   }
+
+   write_signed_head (request, lst, signature, head->str);
+   head->len = head_len;
+   head->str[head_len] = '\0';
+
+   iov[0].iov_base = head->str;
+   iov[0].iov_len = head->len;
+   /* the payload is referenced, not copied */
+   if (request->payload->len) {
+      iov[1].iov_base = request->payload->str;
+      iov[1].iov_len = request->payload->len;
+   }
+
+   for (i = 0; i < request->borrowed_count; i++) {
+      iov[1 + i] = request->borrowed[i];
+   }
+
+done:
+   return iov_count;
+}
+
+/* the longest a presigned URL may be valid, in seconds */
+#define PRESIGN_MAX_EXPIRES (7 * 24 * 60 * 60)
+
+static void
+add_query_param (kms_kv_list_t *lst, const char *key, kms_request_str_t *value)
+{
+   kms_kv_list_add_chars (lst, key, strlen (key), value->str, value->len);
+}
+
+/* docs.aws.amazon.com/general/latest/gr/sigv4-add-signature-to-request.html
+ * "Adding Signing Information to the Query String" */
+char *
+kms_request_get_presigned_url (kms_request_t *request, unsigned int expires)
+{
+   kms_kv_t stack_kvs[KV_SORT_STACK];
+   kms_kv_list_t *sorted;
+   kms_kv_list_t headers;
+   kms_kv_list_t *query = NULL;
+   kms_request_str_t *v = NULL;
+   kms_request_str_t *url = NULL;
+   const kms_kv_t *host;
+   canonical_sink_t sink;
+   char payload_hash[KMS_PAYLOAD_HASH_MAX];
+   unsigned char creq_hash[32];
+   unsigned char signature[32];
+   size_t i;
+
+   kms_request_validate (request);
+   if (request->failed || !finalize (request)) {
+      return NULL;
+   }
+
+   if (expires < 1 || expires > PRESIGN_MAX_EXPIRES) {
+      KMS_ERROR (request,
+                 "Expiration must be 1 to %d seconds, not %u",
+                 PRESIGN_MAX_EXPIRES,
+                 expires);
+      return NULL;
+   }
+
+   if (!init_signing_state (request) ||
+       !get_payload_hash (request, payload_hash)) {
+      KMS_ERROR (request, "Could not hash payload");
+      return NULL;
+   }
+
+   /* the date moves to the query, the rest borrows the sorted headers */
+   sorted = canonical_headers (request);
+   headers = *sorted;
+   headers.kvs = stack_kvs;
+   if (sorted->len > KV_SORT_STACK) {
+      headers.kvs = kms_malloc (sorted->len * sizeof (kms_kv_t));
+      if (!headers.kvs) {
+         KMS_ERROR (request, "Could not allocate headers");
+         return NULL;
+      }
+   }
+
+   headers.len = 0;
+   for (i = 0; i < sorted->len; i++) {
+      if (sorted->kvs[i].id != KMS_HEADER_X_AMZ_DATE) {
+         headers.kvs[headers.len++] = sorted->kvs[i];
+      }
+   }
+
+   headers.kept = headers.size = headers.len;
+
+   query = kms_kv_list_dup (request->query_params);
+   v = kms_request_str_new_from_chars ("AWS4-HMAC-SHA256", -1);
+   add_query_param (query, "X-Amz-Algorithm", v);
+   /* like "AKIDEXAMPLE/20150830/us-east-1/service/aws4_request" */
+   v->len = 0;
+   kms_request_str_append (v, request->access_key_id);
+   kms_request_str_append_char (v, '/');
+   kms_request_str_append (v, &request->date);
+   kms_request_str_append_char (v, '/');
+   kms_request_str_append (v, request->region);
+   kms_request_str_append_char (v, '/');
+   kms_request_str_append (v, request->service);
+   kms_request_str_append_chars (v, "/aws4_request", -1);
+   add_query_param (query, "X-Amz-Credential", v);
+   add_query_param (query, "X-Amz-Date", &request->datetime);
+   v->len = 0;
+   kms_request_str_appendf (v, "%u", expires);
+   add_query_param (query, "X-Amz-Expires", v);
+   v->len = 0;
+   append_signed_headers (&headers, v);
+   add_query_param (query, "X-Amz-SignedHeaders", v);
+
+   clear_str (request->creq_buf);
+   sink_init (&sink, request->creq_buf, request->creq_hash);
+   sink.failed = !kms_sha256_ctx_reset (sink.hash);
+   if (!sink.failed) {
+      append_canonical_prefix (
+         request->method, request->path, query, request->creq_path, &sink);
+      append_canonical_tail (&headers, payload_hash, &sink);
+      sink_flush (&sink, 0);
+   }
+
+   if (sink.failed || !kms_sha256_ctx_final (sink.hash, creq_hash) ||
+       !sign_hashed (request, creq_hash, NULL, signature)) {
+      KMS_ERROR (request, "Could not sign URL");
+      goto done;
+   }
+
+   /* like "https://host/path?X-Amz-Algorithm=...&X-Amz-Signature=..." */
+   url = kms_request_str_new_from_chars ("https://", -1);
+   host = find_header (request, KMS_HEADER_HOST);
+   kms_request_str_append (url, host->value);
+   /* the path as it was signed, the raw one may not be valid in a URL */
+   append_canonical_path (url, request->path, request->creq_path);
+   kms_request_str_append_char (url, '?');
+   /* the same sorted, escaped query that was signed */
+   clear_str (sink.str);
+   sink.hash = NULL;
+   append_canonical_query (query, &sink);
+   kms_request_str_append (url, sink.str);
+   kms_request_str_append_chars (url, "&X-Amz-Signature=", -1);
+   kms_request_str_append_hex (url, signature, sizeof (signature));
+
+done:
+   kms_request_str_destroy (v);
+   kms_kv_list_destroy (query);
+   if (headers.kvs != stack_kvs) {
+      kms_free (headers.kvs);
+   }
+
+   return url ? kms_request_str_detach (url) : NULL;
+}
+
+#define STREAMING_PAYLOAD "STREAMING-AWS4-HMAC-SHA256-PAYLOAD"
+#define CHUNK_SIGNATURE ";chunk-signature="
+
+/* length of an aws-chunked frame with "len" bytes of data, like
+ * "400;chunk-signature=<64 hex digits>\r\n<data>\r\n" */
+static size_t
+chunk_frame_len (size_t len)
+{
+   size_t hex_digits = 1;
+
+   while (len >> (4 * hex_digits)) {
+      hex_digits++;
+   }
+
+   return hex_digits + LITERAL_LEN (CHUNK_SIGNATURE) + 64 + 2 + len + 2;
+}
+
+bool
+kms_request_set_chunked_upload (kms_request_t *request,
+                                size_t decoded_len,
+                                size_t chunk_size)
+{
+   kms_request_str_t *len;
+   size_t encoded_len;
+
+   CHECK_FAILED;
+
+   if (payload_len (request)) {
+      KMS_ERROR (request, "Cannot make a request with a payload chunked");
+      return false;
+   }
+
+   if (chunk_size == 0) {
+      KMS_ERROR (request, "Chunk size must be positive");
+      return false;
+   }
+
+   /* docs.aws.amazon.com/AmazonS3/latest/API/sigv4-streaming.html
+    * all chunks have chunk_size bytes except the last two, the last of which
+    * is empty */
+   encoded_len = (decoded_len / chunk_size) * chunk_frame_len (chunk_size) +
+                 chunk_frame_len (0);
+   if (decoded_len % chunk_size) {
+      encoded_len += chunk_frame_len (decoded_len % chunk_size);
+   }
+
+   forget_signature (request);
+   strcpy (request->payload_hash_preset, STREAMING_PAYLOAD);
+   request->chunked = true;
+   request->chunk_size = chunk_size;
+   request->chunk_decoded_len = decoded_len;
+
+   kms_request_add_header_field (request, "Content-Encoding", "aws-chunked");
+   len = kms_request_str_new ();
+   kms_request_str_appendf (len, "%zu", encoded_len);
+   kms_request_add_header_field (request, "Content-Length", len->str);
+   len->len = 0;
+   kms_request_str_appendf (len, "%zu", decoded_len);
+   kms_request_add_header_field (
+      request, "X-Amz-Decoded-Content-Length", len->str);
+   kms_request_str_destroy (len);
+   if (!find_header (request, KMS_HEADER_X_AMZ_CONTENT_SHA256)) {
+      kms_request_add_header_field (
+         request, "X-Amz-Content-Sha256", STREAMING_PAYLOAD);
+   }
+
+   return true;
+}
+
+size_t
+kms_request_get_chunk_iov (kms_request_t *request,
+                           const char *data,
+                           size_t len,
+                           kms_request_iovec_t *iov)
+{
+   kms_request_str_t *sts = NULL;
+   unsigned char data_hash[32];
+   size_t expect_len;
+   size_t iov_count = 0;
+
+   if (request->failed) {
+      return 0;
+   }
+
+   if (!request->chunked || !request->chunk_seeded) {
+      KMS_ERROR (request, "Sign a chunked upload before its chunks");
+      return 0;
+   }
+
+   if (request->chunk_done) {
+      KMS_ERROR (request, "The final chunk was already sent");
+      return 0;
+   }
+
+   expect_len = request->chunk_remaining < request->chunk_size
+                   ? request->chunk_remaining
+                   : request->chunk_size;
+   if (len != expect_len) {
+      KMS_ERROR (
+         request, "Chunk of %zu bytes, expected %zu bytes", len, expect_len);
+      return 0;
+   }
+
+   if (!request->chunk_key) {
+      /* held until the next seed signature, every chunk needs it */
+      request->chunk_key = get_signing_key (request);
+      if (!request->chunk_key) {
+         KMS_ERROR (request, "Could not derive signing key");
+         return 0;
+      }
+   }
+
+   if (!kms_sha256 (data, len, data_hash)) {
+      KMS_ERROR (request, "Could not hash chunk");
+      return 0;
+   }
+
+   /* each signature covers the previous one, starting from the seed */
+   sts = kms_request_str_new_from_chars ("AWS4-HMAC-SHA256-PAYLOAD\n", -1);
+   kms_request_str_append (sts, &request->datetime);
+   kms_request_str_append_newline (sts);
+   kms_request_str_append (sts, &request->date);
+   kms_request_str_append_char (sts, '/');
+   kms_request_str_append (sts, request->region);
+   kms_request_str_append_char (sts, '/');
+   kms_request_str_append (sts, request->service);
+   kms_request_str_append_chars (sts, "/aws4_request\n", -1);
+   kms_request_str_append_hex (sts, request->chunk_signature, 32);
+   kms_request_str_append_chars (sts, "\n" EMPTY_PAYLOAD_HASH "\n", -1);
+   kms_request_str_append_hex (sts, data_hash, 32);
+
+   if (!kms_sha256_hmac_compute (request->chunk_key->hmac,
+                                 sts->str,
+                                 sts->len,
+                                 request->chunk_signature)) {
+      KMS_ERROR (request, "Could not sign chunk");
+      goto done;
+   }
+
+   /* the frame header is owned by the request and reused by later calls */
+   if (!request->chunk_head) {
+      request->chunk_head = kms_request_str_new ();
+   }
+
+   request->chunk_head->len = 0;
+   kms_request_str_appendf (request->chunk_head, "%zx" CHUNK_SIGNATURE, len);
+   kms_request_str_append_hex (
+      request->chunk_head, request->chunk_signature, 32);
+   kms_request_str_append_chars (request->chunk_head, "\r\n", 2);
+
+   iov[0].iov_base = request->chunk_head->str;
+   iov[0].iov_len = request->chunk_head->len;
+   iov[1].iov_base = data;
+   iov[1].iov_len = len;
+   iov[2].iov_base = "\r\n";
+   iov[2].iov_len = 2;
+   iov_count = KMS_REQUEST_CHUNK_IOV_COUNT;
+
+   request->chunk_remaining -= len;
+   request->chunk_done = len == 0;
+
+done:
+   kms_request_str_destroy (sts);
+
+   return iov_count;
+}
+
+/* where each header in a request's canonical_headers list came from, so a
+ * request with the same header names in the same order can skip the sort */
+typedef struct {
+   const kms_request_t *request;
+   /* an index into request->header_fields, or header_fields->len plus an
+    * index into the template's header_fields */
+   size_t *from;
+   size_t len;
+} header_layout_t;
+
+static bool
+layout_record (header_layout_t *layout,
+               const kms_request_t *request,
+               const kms_kv_list_t *lst)
+{
+   const kms_kv_list_t *own = request->header_fields;
+   size_t *from;
+   size_t i, j;
+
+   from = kms_realloc (layout->from, (lst->len + 1) * sizeof (size_t));
+   if (!from) {
+      return false;
+   }
+
+   layout->from = from;
+   layout->request = request;
+   layout->len = lst->len;
+
+   for (i = 0; i < lst->len; i++) {
+      /* the list borrows its keys, compare pointers */
+      for (j = 0; j < own->len; j++) {
+         if (own->kvs[j].key == lst->kvs[i].key) {
+            break;
+         }
+      }
+
+      if (j == own->len) {
+         for (j = 0; request->tmpl->header_fields->kvs[j].key !=
+                     lst->kvs[i].key;
+              j++) {
+         }
+
+         j += own->len;
+      }
+
+      layout->from[i] = j;
+   }
+
+   return true;
+}
+
+static bool
+layout_matches (const header_layout_t *layout, const kms_request_t *request)
+{
+   const kms_kv_list_t *a;
+   const kms_kv_list_t *b;
+   size_t i;
+
+   if (!layout->request || layout->request->tmpl != request->tmpl) {
+      return false;
+   }
+
+   a = layout->request->header_fields;
+   b = request->header_fields;
+   if (a->len != b->len) {
+      return false;
+   }
+
+   for (i = 0; i < a->len; i++) {
+      if (!kms_kv_same_key (&a->kvs[i], &b->kvs[i])) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+/* canonical_headers, reusing the previous request's order if possible. NULL
+ * if out of memory */
+static kms_kv_list_t *
+batch_headers (kms_request_t *request, header_layout_t *layout)
+{
+   const kms_kv_list_t *own = request->header_fields;
+   kms_kv_list_t *lst;
+   size_t i;
+
+   if (!layout_matches (layout, request)) {
+      lst = headers_copy (canonical_headers (request));
+      if (lst && !layout_record (layout, request, lst)) {
+         headers_destroy (lst);
+         lst = NULL;
+      }
+
+      return lst;
+   }
+
+   lst = headers_new (layout->len);
+   if (!lst) {
+      return NULL;
+   }
+
+   for (i = 0; i < layout->len; i++) {
+      lst->kvs[i] = layout->from[i] < own->len
+                       ? own->kvs[layout->from[i]]
+                       : request->tmpl->header_fields
+                            ->kvs[layout->from[i] - own->len];
+   }
+
+   layout->request = request;
+
+   return lst;
+}
+
+static bool
+same_str (const kms_request_str_t *a, const kms_request_str_t *b)
+{
+   return a == b || (a->len == b->len && 0 == memcmp (a->str, b->str, a->len));
+}
+
+/* do two requests have the same signing key? */
+static bool
+same_scope (const kms_request_t *a, const kms_request_t *b)
+{
+   return same_str (a->secret_key, b->secret_key) &&
+          same_str (&a->date, &b->date) && same_str (a->region, b->region) &&
+          same_str (a->service, b->service);
+}
+
+/* out of memory for the whole batch */
+static void
+batch_alloc_error (kms_request_t **requests, size_t n)
+{
+   size_t i;
+
+   for (i = 0; i < n; i++) {
+      KMS_ERROR (requests[i], "Could not allocate batch");
+   }
+}
+
+char *
+kms_request_sign_batch (kms_request_t **requests,
+                        size_t n,
+                        kms_request_iovec_t *signed_out)
+{
+   kms_kv_list_t **lsts;
+   kms_request_str_t **creqs;
+   const char **creq_chars;
+   size_t *creq_lens;
+   unsigned char *hashes;
+   unsigned char *signatures;
+   header_layout_t layout = {0};
+   kms_signing_key_t *signing_key = NULL;
+   kms_request_t *request;
+   kms_request_t *prev = NULL;
+   size_t slots;
+   size_t total = 0;
+   size_t len;
+   size_t i;
+   char *arena = NULL;
+   char *p;
+
+   /* never malloc (0) */
+   slots = n ? n : 1;
+   lsts = kms_calloc (slots, sizeof (kms_kv_list_t *));
+   creqs = kms_calloc (slots, sizeof (kms_request_str_t *));
+   creq_chars = kms_calloc (slots, sizeof (char *));
+   creq_lens = kms_calloc (slots, sizeof (size_t));
+   /* canonical request hashes, then signatures */
+   hashes = kms_malloc (slots * 2 * 32);
+   if (!lsts || !creqs || !creq_chars || !creq_lens || !hashes) {
+      batch_alloc_error (requests, n);
+      goto done;
+   }
+
+   signatures = hashes + n * 32;
+
+   for (i = 0; i < n; i++) {
+      request = requests[i];
+      kms_request_validate (request);
+      if (request->failed || !finalize (request)) {
+         goto done;
+      }
+
+      lsts[i] = batch_headers (request, &layout);
+      if (!lsts[i]) {
+         KMS_ERROR (request, "Could not allocate headers");
+         goto done;
+      }
+
+      creqs[i] = canonical_request (request, lsts[i]);
+      if (!creqs[i]) {
+         KMS_ERROR (request, "Could not hash payload");
+         goto done;
+      }
+
+      creq_chars[i] = creqs[i]->str;
+      creq_lens[i] = creqs[i]->len;
+      /* each one is nil-terminated */
+      total += signed_len (request, lsts[i]) + 1;
+   }
+
+   /* the canonical requests are independent, hash them side by side */
+   if (!kms_sha256_many (n, creq_chars, creq_lens, hashes)) {
+      if (n) {
+         KMS_ERROR (requests[0], "Could not hash canonical requests");
+      }
+
+      goto done;
+   }
+
+   for (i = 0; i < n; i++) {
+      request = requests[i];
+      /* requests for the same key and date share one signing key */
+      if (!prev || !same_scope (prev, request)) {
+         kms_signing_key_release (signing_key);
+         signing_key = get_signing_key (request);
+         if (!signing_key) {
+            KMS_ERROR (request, "Could not derive signing key");
+            goto done;
+         }
+      }
+
+      if (!sign_hashed (
+             request, hashes + i * 32, signing_key, signatures + i * 32)) {
+         KMS_ERROR (request, "Could not sign request");
+         goto done;
+      }
+
+      prev = request;
+   }
+
+   /* one allocation for all of them */
+   arena = kms_malloc (total ? total : 1);
+   if (!arena) {
+      batch_alloc_error (requests, n);
+      goto done;
+   }
+
+   p = arena;
+
+   for (i = 0; i < n; i++) {
+      len = signed_len (requests[i], lsts[i]);
+      write_signed (requests[i], lsts[i], signatures + i * 32, p);
+      signed_out[i].iov_base = p;
+      signed_out[i].iov_len = len;
+      p += len;
+      *p++ = '\0';
+   }
+
+done:
+   kms_signing_key_release (signing_key);
+   for (i = 0; i < n; i++) {
+      if (lsts && lsts[i]) {
+         headers_destroy (lsts[i]);
+      }
+
+      if (creqs) {
+         kms_request_str_destroy (creqs[i]);
+      }
+   }
+
+   kms_free (hashes);
+   kms_free (creq_lens);
+   kms_free (creq_chars);
+   kms_free (creqs);
+   kms_free (lsts);
+   kms_free (layout.from);
+
+   return arena;
+}
+
+kms_request_template_t *
+kms_request_template_new (kms_request_t *request)
+{
+   kms_request_template_t *tmpl;
+   kms_kv_list_t *lst;
+   kms_request_str_t *normalized;
+   canonical_sink_t sink;
+
+   if (request->failed) {
+      return NULL;
+   }
+
+   if (request->finalized) {
+      KMS_ERROR (request, "Cannot create a template from a signed request");
+      return NULL;
+   }
+
+   unshare (request);
+
+   tmpl = kms_calloc (1, sizeof (kms_request_template_t));
+   tmpl->region = kms_request_str_dup (request->region);
+   tmpl->service = kms_request_str_dup (request->service);
+   tmpl->access_key_id = kms_request_str_dup (request->access_key_id);
+   tmpl->secret_key = kms_request_str_dup (request->secret_key);
+   tmpl->method = kms_request_str_dup (request->method);
+   tmpl->path = kms_request_str_dup (request->path);
+   tmpl->query = kms_request_str_dup (request->query);
+   tmpl->query_params = kms_kv_list_dup (request->query_params);
+   tmpl->content_sha256_header = request->content_sha256_header;
+   tmpl->auto_content_length = request->auto_content_length;
+   tmpl->arena = request->arena != NULL;
+
+   /* each request gets its own date */
+   lst = kms_kv_list_dup (request->header_fields);
+   kms_kv_list_del (lst, "X-Amz-Date");
+   if (!kms_kv_list_find_id (lst, KMS_HEADER_HOST)) {
+      add_host_header (lst, request->service, request->region);
+      tmpl->auto_host = true;
+   }
+
+   kms_kv_list_sort (lst, cmp_header_field_names);
+   tmpl->header_fields = lst;
+
+   normalized = kms_request_str_new ();
+   sink_init (&sink, kms_request_str_new (), NULL);
+   append_canonical_prefix (request->method,
+                            request->path,
+                            request->query_params,
+                            normalized,
+                            &sink);
+   tmpl->canonical_prefix = sink.str;
+   kms_request_str_destroy (normalized);
+
+   return tmpl;
+}
+
+void
+kms_request_template_destroy (kms_request_template_t *tmpl)
+{
+   if (!tmpl) {
+      return;
    }
 
-   return kms_request_str_detach (sreq);
+   kms_request_str_destroy (tmpl->region);
+   kms_request_str_destroy (tmpl->service);
+   kms_request_str_destroy (tmpl->access_key_id);
+   kms_request_str_destroy (tmpl->secret_key);
+   kms_request_str_destroy (tmpl->method);
+   kms_request_str_destroy (tmpl->path);
+   kms_request_str_destroy (tmpl->query);
+   kms_kv_list_destroy (tmpl->query_params);
+   kms_kv_list_destroy (tmpl->header_fields);
+   kms_request_str_destroy (tmpl->canonical_prefix);
+   kms_free (tmpl);
 }
 
 void
 kms_request_free_string (char* ptr) {
-   free(ptr);
+   kms_free (ptr);
 }
@@ -16,19 +16,20 @@
  */
 
 #include "kms_request_opt_private.h"
+#include "kms_alloc.h"
 
 #include <stdlib.h>
 
 kms_request_opt_t *
 kms_request_opt_new (void)
 {
-   return calloc (1, sizeof (kms_request_opt_t));
+   return kms_calloc (1, sizeof (kms_request_opt_t));
 }
 
 void
 kms_request_opt_destroy (kms_request_opt_t *request)
 {
-   free (request);
+   kms_free (request);
 }
 
 void
@@ -37,3 +38,16 @@ kms_request_opt_set_connection_close (kms_request_opt_t *opt,
 {
    opt->connection_close = connection_close;
 }
+
+void
+kms_request_opt_set_content_sha256_header (kms_request_opt_t *opt,
+                                           bool content_sha256_header)
+{
+   opt->content_sha256_header = content_sha256_header;
+}
+
+void
+kms_request_opt_set_arena (kms_request_opt_t *opt, bool arena)
+{
+   opt->arena = arena;
+}
@@ -24,6 +24,8 @@
 
 struct _kms_request_opt_t {
    bool connection_close;
+   bool content_sha256_header;
+   bool arena;
 };
 
 #endif /* KMS_REQUEST_OPT_PRIVATE_H */
@@ -15,6 +15,7 @@
  */
 
 #include "hexlify.h"
+#include "kms_alloc.h"
 #include "kms_crypto.h"
 #include "kms_message/kms_message.h"
 #include "kms_request_str.h"
@@ -26,25 +27,39 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
-bool rfc_3986_tab[256] = {0};
-bool kms_initialized = false;
-
-static void
-tables_init ()
-{
-   int i;
-
-   if (kms_initialized) {
-      return;
-   }
-
-   for (i = 0; i < 256; ++i) {
-      rfc_3986_tab[i] =
-         isalnum (i) || i == '~' || i == '-' || i == '.' || i == '_';
-   }
-
-   kms_initialized = true;
-}
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+#define KMS_ESCAPE_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define KMS_ESCAPE_NEON
+#include <arm_neon.h>
+#endif
+
+#define ESCAPE_UNRESERVED 1
+#define ESCAPE_SLASH 2
+
+/* ESCAPE_UNRESERVED for RFC 3986 unreserved characters: ALPHA / DIGIT / "-" /
+ * "." / "_" / "~", ESCAPE_SLASH for "/" */
+static const uint8_t rfc_3986_tab[256] = {
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2,
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+   0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+   0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const char hex_upper[] = "0123456789ABCDEF";
 
 static char *
 kms_strdupv_printf (const char *format, va_list args)
@@ -56,7 +71,7 @@ kms_strdupv_printf (const char *format, va_list args)
 
    assert (format);
 
-   buf = malloc ((size_t) len);
+   buf = kms_malloc ((size_t) len);
 
    while (true) {
       va_copy (my_args, args);
@@ -73,32 +88,77 @@ kms_strdupv_printf (const char *format, va_list args)
          len *= 2;
       }
 
-      buf = realloc (buf, (size_t) len);
+      buf = kms_realloc (buf, (size_t) len);
+   }
+}
+
+static bool
+is_inline (const kms_request_str_t *str)
+{
+   return str->str == str->inline_buf;
+}
+
+void
+kms_request_str_init (kms_request_str_t *str)
+{
+   str->arena = NULL;
+   str->str = str->inline_buf;
+   str->len = 0;
+   str->size = KMS_REQUEST_STR_INLINE;
+   str->str[0] = '\0';
+}
+
+void
+kms_request_str_cleanup (kms_request_str_t *str)
+{
+   if (!is_inline (str) && !str->arena) {
+      kms_free (str->str);
    }
+
+   str->str = NULL;
+}
+
+static void *
+str_alloc (kms_arena_t *arena, size_t size)
+{
+   return arena ? kms_arena_alloc (arena, size) : kms_malloc (size);
 }
 
 kms_request_str_t *
-kms_request_str_new (void)
+kms_request_str_new_in (kms_arena_t *arena)
 {
-   kms_request_str_t *s = malloc (sizeof (kms_request_str_t));
+   kms_request_str_t *s = str_alloc (arena, sizeof (kms_request_str_t));
 
-   s->len = 0;
-   s->size = 16;
-   s->str = malloc (s->size);
-   s->str[0] = '\0';
+   kms_request_str_init (s);
+   s->arena = arena;
 
    return s;
 }
 
 kms_request_str_t *
-kms_request_str_new_from_chars (const char *chars, ssize_t len)
+kms_request_str_new (void)
+{
+   return kms_request_str_new_in (NULL);
+}
+
+kms_request_str_t *
+kms_request_str_new_from_chars_in (kms_arena_t *arena,
+                                   const char *chars,
+                                   ssize_t len)
 {
-   kms_request_str_t *s = malloc (sizeof (kms_request_str_t));
+   kms_request_str_t *s = str_alloc (arena, sizeof (kms_request_str_t));
    size_t actual_len;
 
+   s->arena = arena;
    actual_len = len < 0 ? strlen (chars) : (size_t) len;
-   s->size = actual_len + 1;
-   s->str = malloc (s->size);
+   if (actual_len < KMS_REQUEST_STR_INLINE) {
+      s->str = s->inline_buf;
+      s->size = KMS_REQUEST_STR_INLINE;
+   } else {
+      s->size = actual_len + 1;
+      s->str = str_alloc (arena, s->size);
+   }
+
    memcpy (s->str, chars, actual_len);
    s->str[actual_len] = '\0';
    s->len = actual_len;
@@ -106,11 +166,18 @@ kms_request_str_new_from_chars (const char *chars, ssize_t len)
    return s;
 }
 
+kms_request_str_t *
+kms_request_str_new_from_chars (const char *chars, ssize_t len)
+{
+   return kms_request_str_new_from_chars_in (NULL, chars, len);
+}
+
 kms_request_str_t *
 kms_request_str_wrap (char *chars, ssize_t len)
 {
-   kms_request_str_t *s = malloc (sizeof (kms_request_str_t));
+   kms_request_str_t *s = kms_malloc (sizeof (kms_request_str_t));
 
+   s->arena = NULL;
    s->str = chars;
    s->len = len < 0 ? strlen (chars) : (size_t) len;
    s->size = s->len;
@@ -121,19 +188,28 @@ kms_request_str_wrap (char *chars, ssize_t len)
 void
 kms_request_str_destroy (kms_request_str_t *str)
 {
-   if (!str) {
+   if (!str || str->arena) {
       return;
    }
 
-   free (str->str);
-   free (str);
+   kms_request_str_cleanup (str);
+   kms_free (str);
 }
 
+/* returns a buffer to free with kms_free () */
 char *
 kms_request_str_detach (kms_request_str_t *str)
 {
-   char *r = str->str;
-   free (str);
+   char *r;
+
+   if (is_inline (str) || str->arena) {
+      r = kms_strndup (str->str, str->len);
+      kms_request_str_destroy (str);
+      return r;
+   }
+
+   r = str->str;
+   kms_free (str);
    return r;
 }
 
@@ -158,23 +234,33 @@ kms_request_str_reserve (kms_request_str_t *str, size_t size)
       next_size |= next_size >> 16U;
       ++next_size;
 
+      if (is_inline (str)) {
+         str->str = str_alloc (str->arena, next_size);
+         memcpy (str->str, str->inline_buf, str->len + 1);
+      } else if (str->arena) {
+         str->str =
+            kms_arena_realloc (str->arena, str->str, str->size, next_size);
+      } else {
+         str->str = kms_realloc (str->str, next_size);
+      }
+
       str->size = next_size;
-      str->str = realloc (str->str, next_size);
    }
 
    return str->str != NULL;
 }
 
 kms_request_str_t *
-kms_request_str_dup (kms_request_str_t *str)
+kms_request_str_dup_in (kms_arena_t *arena, kms_request_str_t *str)
 {
-   kms_request_str_t *dup = malloc (sizeof (kms_request_str_t));
-
-   dup->str = strndup (str->str, str->len);
-   dup->len = str->len;
-   dup->size = str->len + 1;
+   return kms_request_str_new_from_chars_in (
+      arena, str->str, (ssize_t) str->len);
+}
 
-   return dup;
+kms_request_str_t *
+kms_request_str_dup (kms_request_str_t *str)
+{
+   return kms_request_str_dup_in (NULL, str);
 }
 
 void
@@ -183,8 +269,12 @@ kms_request_str_set_chars (kms_request_str_t *str,
                            ssize_t len)
 {
    size_t actual_len = len < 0 ? strlen (chars) : (size_t) len;
+
+   /* replacing, room for the new chars is enough */
+   str->len = 0;
    kms_request_str_reserve (str, actual_len); /* adds 1 for nil */
-   memcpy (str->str, chars, actual_len + 1);
+   memcpy (str->str, chars, actual_len);
+   str->str[actual_len] = '\0';
    str->len = actual_len;
 }
 
@@ -292,35 +382,203 @@ kms_request_str_appendf (kms_request_str_t *str, const char *format, ...)
    }
 }
 
+/* copy the bytes in "keep", percent-encode the rest */
+static uint8_t *
+escape_bytes (uint8_t *out, const uint8_t *in, size_t len, uint8_t keep)
+{
+   const uint8_t *end = in + len;
+
+   for (; in < end; ++in) {
+      if (rfc_3986_tab[*in] & keep) {
+         *out++ = *in;
+      } else {
+         out[0] = '%';
+         out[1] = (uint8_t) hex_upper[*in >> 4];
+         out[2] = (uint8_t) hex_upper[*in & 0xf];
+         out += 3;
+      }
+   }
+
+   return out;
+}
+
+/* The vector paths copy runs of unreserved bytes a block at a time and leave
+ * the bytes after the first reserved one in a block to escape_bytes. They may
+ * store a whole block at "out" before advancing by less: the caller reserves
+ * 3 bytes of output per input byte, so there is room.
+ *
+ * "slash" is the extra byte to keep, "/" or a duplicate of "-". */
+
+#ifdef KMS_ESCAPE_X86
+
+static __m128i
+unreserved_sse2 (__m128i v, __m128i slash)
+{
+   /* bytes >= 0x80 are negative, and outside every range */
+   __m128i lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+   __m128i alpha =
+      _mm_and_si128 (_mm_cmpgt_epi8 (lower, _mm_set1_epi8 ('a' - 1)),
+                     _mm_cmplt_epi8 (lower, _mm_set1_epi8 ('z' + 1)));
+   __m128i digit = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('0' - 1)),
+                                  _mm_cmplt_epi8 (v, _mm_set1_epi8 ('9' + 1)));
+   __m128i punct =
+      _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('-')),
+                                  _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('.'))),
+                    _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('_')),
+                                  _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('~'))));
+
+   return _mm_or_si128 (_mm_or_si128 (alpha, digit),
+                        _mm_or_si128 (punct, _mm_cmpeq_epi8 (v, slash)));
+}
+
+static uint8_t *
+escape_sse2 (uint8_t *out, const uint8_t **inp, size_t len, uint8_t keep)
+{
+   const uint8_t *in = *inp;
+   const uint8_t *end = in + len;
+   __m128i slash = _mm_set1_epi8 ((keep & ESCAPE_SLASH) ? '/' : '-');
+   __m128i v;
+   unsigned mask;
+   unsigned run;
+
+   while (end - in >= 16) {
+      v = _mm_loadu_si128 ((const __m128i *) in);
+      mask = (unsigned) _mm_movemask_epi8 (unreserved_sse2 (v, slash));
+      _mm_storeu_si128 ((__m128i *) out, v);
+      if (mask == 0xffff) {
+         out += 16;
+      } else {
+         run = (unsigned) __builtin_ctz (~mask);
+         out = escape_bytes (out + run, in + run, 16 - run, keep);
+      }
+
+      in += 16;
+   }
+
+   *inp = in;
+   return out;
+}
+
+static __attribute__ ((target ("avx2"))) __m256i
+unreserved_avx2 (__m256i v, __m256i slash)
+{
+   __m256i lower = _mm256_or_si256 (v, _mm256_set1_epi8 (0x20));
+   __m256i alpha =
+      _mm256_and_si256 (_mm256_cmpgt_epi8 (lower, _mm256_set1_epi8 ('a' - 1)),
+                        _mm256_cmpgt_epi8 (_mm256_set1_epi8 ('z' + 1), lower));
+   __m256i digit =
+      _mm256_and_si256 (_mm256_cmpgt_epi8 (v, _mm256_set1_epi8 ('0' - 1)),
+                        _mm256_cmpgt_epi8 (_mm256_set1_epi8 ('9' + 1), v));
+   __m256i punct = _mm256_or_si256 (
+      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('-')),
+                       _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('.'))),
+      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('_')),
+                       _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('~'))));
+
+   return _mm256_or_si256 (
+      _mm256_or_si256 (alpha, digit),
+      _mm256_or_si256 (punct, _mm256_cmpeq_epi8 (v, slash)));
+}
+
+static __attribute__ ((target ("avx2"))) uint8_t *
+escape_avx2 (uint8_t *out, const uint8_t **inp, size_t len, uint8_t keep)
+{
+   const uint8_t *in = *inp;
+   const uint8_t *end = in + len;
+   __m256i slash = _mm256_set1_epi8 ((keep & ESCAPE_SLASH) ? '/' : '-');
+   __m256i v;
+   uint32_t mask;
+   unsigned run;
+
+   while (end - in >= 32) {
+      v = _mm256_loadu_si256 ((const __m256i *) in);
+      mask = (uint32_t) _mm256_movemask_epi8 (unreserved_avx2 (v, slash));
+      _mm256_storeu_si256 ((__m256i *) out, v);
+      if (mask == 0xffffffff) {
+         out += 32;
+      } else {
+         run = (unsigned) __builtin_ctz (~mask);
+         out = escape_bytes (out + run, in + run, 32 - run, keep);
+      }
+
+      in += 32;
+   }
+
+   *inp = in;
+   return out;
+}
+
+#elif defined(KMS_ESCAPE_NEON)
+
+static uint8_t *
+escape_neon (uint8_t *out, const uint8_t **inp, size_t len, uint8_t keep)
+{
+   const uint8_t *in = *inp;
+   const uint8_t *end = in + len;
+   uint8x16_t slash = vdupq_n_u8 ((keep & ESCAPE_SLASH) ? '/' : '-');
+   uint8x16_t v, lower, ok;
+
+   while (end - in >= 16) {
+      v = vld1q_u8 (in);
+      /* unsigned compares, bytes >= 0x80 are above every range */
+      lower = vorrq_u8 (v, vdupq_n_u8 (0x20));
+      ok = vandq_u8 (vcgeq_u8 (lower, vdupq_n_u8 ('a')),
+                     vcleq_u8 (lower, vdupq_n_u8 ('z')));
+      ok = vorrq_u8 (ok,
+                     vandq_u8 (vcgeq_u8 (v, vdupq_n_u8 ('0')),
+                               vcleq_u8 (v, vdupq_n_u8 ('9'))));
+      ok = vorrq_u8 (ok,
+                     vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('-')),
+                               vceqq_u8 (v, vdupq_n_u8 ('.'))));
+      ok = vorrq_u8 (ok,
+                     vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('_')),
+                               vceqq_u8 (v, vdupq_n_u8 ('~'))));
+      ok = vorrq_u8 (ok, vceqq_u8 (v, slash));
+      if (vminvq_u8 (ok) == 0xff) {
+         vst1q_u8 (out, v);
+         out += 16;
+      } else {
+         out = escape_bytes (out, in, 16, keep);
+      }
+
+      in += 16;
+   }
+
+   *inp = in;
+   return out;
+}
+
+#endif
+
 void
 kms_request_str_append_escaped (kms_request_str_t *str,
                                 kms_request_str_t *appended,
                                 bool escape_slash)
 {
-   uint8_t *in;
+   const uint8_t *in;
+   const uint8_t *end;
    uint8_t *out;
-   size_t i;
-
-   tables_init ();
+   uint8_t keep = ESCAPE_UNRESERVED | (escape_slash ? 0 : ESCAPE_SLASH);
 
    /* might replace each input char with 3 output chars: "%AB" */
    kms_request_str_reserve (str, 3 * appended->len);
-   in = (uint8_t *) appended->str;
+   in = (const uint8_t *) appended->str;
+   end = in + appended->len;
    out = (uint8_t *) str->str + str->len;
 
-   for (i = 0; i < appended->len; ++i) {
-      if (rfc_3986_tab[*in] || (*in == '/' && !escape_slash)) {
-         *out = *in;
-         ++out;
-         ++str->len;
-      } else {
-         sprintf ((char *) out, "%%%02X", *in);
-         out += 3;
-         str->len += 3;
-      }
-
-      ++in;
+#if defined(KMS_ESCAPE_X86)
+   if (__builtin_cpu_supports ("avx2")) {
+      out = escape_avx2 (out, &in, (size_t) (end - in), keep);
    }
+
+   out = escape_sse2 (out, &in, (size_t) (end - in), keep);
+#elif defined(KMS_ESCAPE_NEON)
+   out = escape_neon (out, &in, (size_t) (end - in), keep);
+#endif
+
+   out = escape_bytes (out, in, (size_t) (end - in), keep);
+   str->len = (size_t) ((char *) out - str->str);
+   str->str[str->len] = '\0';
 }
 
 void
@@ -372,35 +630,29 @@ kms_request_str_append_hashed (kms_request_str_t *str,
                                kms_request_str_t *appended)
 {
    uint8_t hash[32];
-   char *hex_chars;
 
    if (!kms_sha256 (appended->str, appended->len, hash)) {
       return false;
    }
 
-   hex_chars = hexlify (hash, sizeof (hash));
-   kms_request_str_append_chars (str, hex_chars, 2 * sizeof (hash));
-   free (hex_chars);
-
-   return true;
+   return kms_request_str_append_hex (str, hash, sizeof (hash));
 }
 
 bool
 kms_request_str_append_hex (kms_request_str_t *str,
-                            unsigned char *data,
+                            const unsigned char *data,
                             size_t len)
 {
-   char *hex_chars;
-
-   hex_chars = hexlify (data, len);
-   kms_request_str_append_chars (str, hex_chars, len * 2);
-   free (hex_chars);
+   kms_request_str_reserve (str, 2 * len);
+   hexlify_into (str->str + str->len, data, len);
+   str->len += 2 * len;
+   str->str[str->len] = '\0';
 
    return true;
 }
 
 static bool
-starts_with (char *s, const char *prefix)
+starts_with (const char *s, const char *prefix)
 {
    if (strstr (s, prefix) == s) {
       return true;
@@ -440,16 +692,16 @@ done:
 
 /* follow algorithm in https://tools.ietf.org/html/rfc3986#section-5.2.4,
  * the block comments are copied from there */
-kms_request_str_t *
-kms_request_str_path_normalized (kms_request_str_t *str)
+void
+kms_request_str_set_path_normalized (kms_request_str_t *out,
+                                     const kms_request_str_t *str)
 {
-   kms_request_str_t *slash = kms_request_str_new_from_chars ("/", 1);
-   kms_request_str_t *out = kms_request_str_new ();
-   char *in = strdup (str->str);
-   char *p = in;
-   char *end = in + str->len;
+   const char *p = str->str;
+   const char *end = str->str + str->len;
    bool is_absolute = (*p == '/');
 
+   kms_request_str_set_chars (out, "", 0);
+
    if (0 == strcmp (p, "/")) {
       goto done;
    }
@@ -491,13 +743,13 @@ kms_request_str_path_normalized (kms_request_str_t *str)
        * any subsequent characters up to, but not including, the next "/"
        * character or the end of the input buffer. */
       else {
-         char *next_slash = strchr (p + 1, '/');
+         const char *next_slash = strchr (p + 1, '/');
          if (!next_slash) {
             next_slash = end;
          }
 
          /* fold repeated slashes */
-         if (kms_request_str_ends_with (out, slash) && *p == '/') {
+         if (out->len && out->str[out->len - 1] == '/' && *p == '/') {
             ++p;
          }
 
@@ -512,12 +764,18 @@ kms_request_str_path_normalized (kms_request_str_t *str)
    }
 
 done:
-   free (in);
-   kms_request_str_destroy (slash);
-
    if (!out->len) {
       kms_request_str_append_char (out, '/');
    }
+}
+
+kms_request_str_t *
+kms_request_str_path_normalized (kms_request_str_t *str)
+{
+   /* in the same arena as the input */
+   kms_request_str_t *out = kms_request_str_new_in (str->arena);
+
+   kms_request_str_set_path_normalized (out, str);
 
    return out;
 }
@@ -17,6 +17,7 @@
 #ifndef KMS_MESSAGE_KMS_REQUEST_STR_H
 #define KMS_MESSAGE_KMS_REQUEST_STR_H
 
+#include "kms_arena.h"
 #include "kms_message/kms_message.h"
 
 #include <stdarg.h>
@@ -29,17 +30,36 @@
 typedef SSIZE_T ssize_t;
 #endif // _WIN32
 
+/* strings this short, with the nil, are stored inline */
+#define KMS_REQUEST_STR_INLINE 24
+
 typedef struct {
-   char *str;
+   char *str; /* "inline_buf", or a buffer from the heap or "arena" */
    size_t len;
    size_t size;
+   /* if set, the string and its buffer are freed with the arena */
+   kms_arena_t *arena;
+   char inline_buf[KMS_REQUEST_STR_INLINE];
 } kms_request_str_t;
 
 KMS_MSG_EXPORT (kms_request_str_t *)
 kms_request_str_new (void);
+/* the _in functions allocate from "arena", or the heap if it is NULL */
+KMS_MSG_EXPORT (kms_request_str_t *)
+kms_request_str_new_in (kms_arena_t *arena);
+/* for a string embedded in another struct, which must not move. free it with
+ * kms_request_str_cleanup */
+KMS_MSG_EXPORT (void)
+kms_request_str_init (kms_request_str_t *str);
+KMS_MSG_EXPORT (void)
+kms_request_str_cleanup (kms_request_str_t *str);
 KMS_MSG_EXPORT (kms_request_str_t *)
 kms_request_str_new_from_chars (const char *chars, ssize_t len);
 KMS_MSG_EXPORT (kms_request_str_t *)
+kms_request_str_new_from_chars_in (kms_arena_t *arena,
+                                   const char *chars,
+                                   ssize_t len);
+KMS_MSG_EXPORT (kms_request_str_t *)
 kms_request_str_wrap (char *chars, ssize_t len);
 KMS_MSG_EXPORT (void)
 kms_request_str_destroy (kms_request_str_t *str);
@@ -49,6 +69,8 @@ KMS_MSG_EXPORT (bool)
 kms_request_str_reserve (kms_request_str_t *str, size_t size);
 KMS_MSG_EXPORT (kms_request_str_t *)
 kms_request_str_dup (kms_request_str_t *str);
+KMS_MSG_EXPORT (kms_request_str_t *)
+kms_request_str_dup_in (kms_arena_t *arena, kms_request_str_t *str);
 KMS_MSG_EXPORT (void)
 kms_request_str_set_chars (kms_request_str_t *str,
                            const char *chars,
@@ -82,9 +104,13 @@ kms_request_str_append_hashed (kms_request_str_t *str,
                                kms_request_str_t *appended);
 KMS_MSG_EXPORT (bool)
 kms_request_str_append_hex (kms_request_str_t *str,
-                            unsigned char *data,
+                            const unsigned char *data,
                             size_t len);
 KMS_MSG_EXPORT (kms_request_str_t *)
 kms_request_str_path_normalized (kms_request_str_t *str);
+/* like kms_request_str_path_normalized, but into "out", reusing its buffer */
+KMS_MSG_EXPORT (void)
+kms_request_str_set_path_normalized (kms_request_str_t *out,
+                                     const kms_request_str_t *str);
 
 #endif // KMS_MESSAGE_KMS_REQUEST_STR_H
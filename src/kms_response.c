@@ -16,6 +16,7 @@
  */
 
 #include "kms_message/kms_message.h"
+#include "kms_alloc.h"
 #include "kms_message_private.h"
 #include "kms_request_str.h"
 
@@ -27,11 +28,19 @@ kms_response_destroy (kms_response_t *response)
    }
    kms_kv_list_destroy (response->headers);
    kms_request_str_destroy (response->body);
-   free (response);
+   kms_free (response);
 }
 
 const char *
 kms_response_get_body (kms_response_t *response)
 {
    return response->body->str;
-}
\ No newline at end of file
+}
+
+const char *
+kms_response_get_header (kms_response_t *response, const char *name)
+{
+   const kms_kv_t *kv = kms_kv_list_find (response->headers, name);
+
+   return kv ? kv->value->str : NULL;
+}
@@ -1,5 +1,6 @@
 #include "kms_message/kms_response_parser.h"
 #include "kms_message_private.h"
+#include "kms_alloc.h"
 
 #include <assert.h>
 #include <limits.h>
@@ -23,7 +24,7 @@ _parser_init (kms_response_parser_t *parser)
 {
    parser->raw_response = kms_request_str_new ();
    parser->content_length = -1;
-   parser->response = calloc (1, sizeof (kms_response_t));
+   parser->response = kms_calloc (1, sizeof (kms_response_t));
    parser->response->headers = kms_kv_list_new ();
    parser->state = PARSING_STATUS_LINE;
    parser->start = 0;
@@ -33,7 +34,7 @@ _parser_init (kms_response_parser_t *parser)
 kms_response_parser_t *
 kms_response_parser_new (void)
 {
-   kms_response_parser_t *parser = malloc (sizeof (kms_response_parser_t));
+   kms_response_parser_t *parser = kms_malloc (sizeof (kms_response_parser_t));
    _parser_init (parser);
    return parser;
 }
@@ -71,13 +72,13 @@ _parse_int (const char *str, int *result)
 static bool
 _parse_int_from_view (const char *str, int start, int end, int *result)
 {
-   char *num_str = malloc (end - start + 1);
+   char *num_str = kms_malloc (end - start + 1);
    bool ret;
 
    strncpy (num_str, str + start, end - start);
    num_str[end - start] = '\0';
    ret = _parse_int (num_str, result);
-   free (num_str);
+   kms_free (num_str);
    return ret;
 }
 
@@ -168,20 +169,19 @@ _parse_line (kms_response_parser_t *parser, int end)
          val = kms_request_str_new_from_chars (raw + i, j - i);
       }
 
-      kms_kv_list_add (response->headers, key, val);
+      kms_kv_list_add_take (response->headers, key, val);
 
-      /* if we have *not* read the Content-Length yet, check. */
+      /* if we have *not* read the Content-Length yet, check. header names
+       * are case-insensitive */
       if (parser->content_length == -1 &&
-          strcmp (key->str, "Content-Length") == 0) {
+          response->headers->kvs[response->headers->len - 1].id ==
+             KMS_HEADER_CONTENT_LENGTH) {
          if (!_parse_int (val->str, &parser->content_length)) {
             KMS_ERROR (parser, "Could not parse Content-Length header.");
-            kms_request_str_destroy (key);
-            kms_request_str_destroy (val);
             return PARSING_DONE;
          }
       }
-      kms_request_str_destroy (key);
-      kms_request_str_destroy (val);
+
       return PARSING_HEADER;
    }
    return PARSING_DONE;
@@ -249,5 +249,5 @@ void
 kms_response_parser_destroy (kms_response_parser_t *parser)
 {
    _parser_destroy (parser);
-   free (parser);
+   kms_free (parser);
 }
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Multi-buffer SHA-256: hash several independent messages at once, one per
+ * SIMD lane. Signing hashes many short inputs, each a few 64-byte blocks,
+ * which leaves a single-stream SHA-256 unable to use the vector units. */
+
+#include "kms_crypto.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+#define KMS_SHA256_MB_X86
+#include <immintrin.h>
+#endif
+
+#define SHA256_BLOCK_LEN 64
+#define SHA256_MAX_LANES 16
+
+#ifdef KMS_SHA256_MB_X86
+
+static const uint32_t sha256_k[64] = {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+   0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+   0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+   0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+   0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+   0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+   0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+   0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t sha256_iv[8] = {0x6a09e667,
+                                      0xbb67ae85,
+                                      0x3c6ef372,
+                                      0xa54ff53a,
+                                      0x510e527f,
+                                      0x9b05688c,
+                                      0x1f83d9ab,
+                                      0x5be0cd19};
+
+/* 4 lanes, SSE2 is part of x86-64 */
+#define MB_COMPRESS compress_sse2
+#define MB_TARGET
+#define MB_LANES 4
+#define MB_VEC __m128i
+#define MB_LOAD(p) _mm_loadu_si128 ((const __m128i *) (p))
+#define MB_STORE(p, v) _mm_storeu_si128 ((__m128i *) (p), (v))
+#define MB_SET1(x) _mm_set1_epi32 ((int) (x))
+#define MB_ADD _mm_add_epi32
+#define MB_XOR _mm_xor_si128
+#define MB_AND _mm_and_si128
+#define MB_OR _mm_or_si128
+#define MB_ANDNOT _mm_andnot_si128
+#define MB_ROTR(v, n) \
+   _mm_or_si128 (_mm_srli_epi32 ((v), (n)), _mm_slli_epi32 ((v), 32 - (n)))
+#define MB_SHR _mm_srli_epi32
+#include "kms_sha256_mb_kernel.h"
+
+/* 8 lanes */
+#define MB_COMPRESS compress_avx2
+#define MB_TARGET __attribute__ ((target ("avx2")))
+#define MB_LANES 8
+#define MB_VEC __m256i
+#define MB_LOAD(p) _mm256_loadu_si256 ((const __m256i *) (p))
+#define MB_STORE(p, v) _mm256_storeu_si256 ((__m256i *) (p), (v))
+#define MB_SET1(x) _mm256_set1_epi32 ((int) (x))
+#define MB_ADD _mm256_add_epi32
+#define MB_XOR _mm256_xor_si256
+#define MB_AND _mm256_and_si256
+#define MB_OR _mm256_or_si256
+#define MB_ANDNOT _mm256_andnot_si256
+#define MB_ROTR(v, n)                        \
+   _mm256_or_si256 (_mm256_srli_epi32 ((v), (n)), \
+                    _mm256_slli_epi32 ((v), 32 - (n)))
+#define MB_SHR _mm256_srli_epi32
+#include "kms_sha256_mb_kernel.h"
+
+/* 16 lanes, with a native rotate */
+#define MB_COMPRESS compress_avx512
+#define MB_TARGET __attribute__ ((target ("avx512f")))
+#define MB_LANES 16
+#define MB_VEC __m512i
+#define MB_LOAD(p) _mm512_loadu_si512 ((const void *) (p))
+#define MB_STORE(p, v) _mm512_storeu_si512 ((void *) (p), (v))
+#define MB_SET1(x) _mm512_set1_epi32 ((int) (x))
+#define MB_ADD _mm512_add_epi32
+#define MB_XOR _mm512_xor_si512
+#define MB_AND _mm512_and_si512
+#define MB_OR _mm512_or_si512
+#define MB_ANDNOT _mm512_andnot_si512
+#define MB_ROTR _mm512_ror_epi32
+#define MB_SHR _mm512_srli_epi32
+#include "kms_sha256_mb_kernel.h"
+
+typedef void (*compress_fn_t) (uint32_t *state, const uint32_t *w);
+
+/* an input being hashed in one lane */
+typedef struct {
+   const unsigned char *data;
+   size_t len;
+   size_t blocks; /* including padding */
+   size_t next;   /* the next block to hash */
+   size_t job;    /* index of the input, or SIZE_MAX if the lane is idle */
+} lane_t;
+
+/* copy block "k" of the padded message into "block" */
+static void
+get_block (const lane_t *lane, size_t k, unsigned char *block)
+{
+   size_t off = k * SHA256_BLOCK_LEN;
+   uint64_t bits = (uint64_t) lane->len * 8;
+   int i;
+
+   if (off + SHA256_BLOCK_LEN <= lane->len) {
+      memcpy (block, lane->data + off, SHA256_BLOCK_LEN);
+      return;
+   }
+
+   memset (block, 0, SHA256_BLOCK_LEN);
+   if (off <= lane->len) {
+      memcpy (block, lane->data + off, lane->len - off);
+      block[lane->len - off] = 0x80;
+   }
+
+   if (k == lane->blocks - 1) {
+      /* message length in bits, big-endian */
+      for (i = 0; i < 8; i++) {
+         block[SHA256_BLOCK_LEN - 1 - i] = (unsigned char) (bits >> (8 * i));
+      }
+   }
+}
+
+/* feed the inputs through "lanes" lanes, starting the next input in a lane as
+ * soon as the previous one there is done */
+static void
+hash_lanes (compress_fn_t compress,
+            size_t lanes,
+            size_t n,
+            const char *const *inputs,
+            const size_t *lens,
+            unsigned char *hashes)
+{
+   uint32_t state[8 * SHA256_MAX_LANES];
+   uint32_t w[16 * SHA256_MAX_LANES];
+   unsigned char block[SHA256_BLOCK_LEN];
+   lane_t lane[SHA256_MAX_LANES];
+   unsigned char *out;
+   size_t next_job = 0;
+   size_t active = 0;
+   size_t l;
+   int i;
+
+   for (l = 0; l < lanes; l++) {
+      lane[l].job = SIZE_MAX;
+   }
+
+   memset (state, 0, sizeof (state));
+
+   for (;;) {
+      for (l = 0; l < lanes; l++) {
+         if (lane[l].job != SIZE_MAX || next_job == n) {
+            continue;
+         }
+
+         lane[l].job = next_job;
+         lane[l].data = (const unsigned char *) inputs[next_job];
+         lane[l].len = lens[next_job];
+         /* room for the 0x80 byte and the 8-byte length */
+         lane[l].blocks = (lens[next_job] + 9 + SHA256_BLOCK_LEN - 1) /
+                          SHA256_BLOCK_LEN;
+         lane[l].next = 0;
+         for (i = 0; i < 8; i++) {
+            state[i * lanes + l] = sha256_iv[i];
+         }
+
+         next_job++;
+         active++;
+      }
+
+      if (!active) {
+         break;
+      }
+
+      /* transpose: word i of each lane's block into row i */
+      for (l = 0; l < lanes; l++) {
+         if (lane[l].job == SIZE_MAX) {
+            memset (block, 0, sizeof (block));
+         } else {
+            get_block (&lane[l], lane[l].next, block);
+         }
+
+         for (i = 0; i < 16; i++) {
+            w[i * lanes + l] = (uint32_t) block[4 * i] << 24 |
+                               (uint32_t) block[4 * i + 1] << 16 |
+                               (uint32_t) block[4 * i + 2] << 8 |
+                               (uint32_t) block[4 * i + 3];
+         }
+      }
+
+      compress (state, w);
+
+      for (l = 0; l < lanes; l++) {
+         if (lane[l].job == SIZE_MAX || ++lane[l].next < lane[l].blocks) {
+            continue;
+         }
+
+         out = hashes + 32 * lane[l].job;
+         for (i = 0; i < 8; i++) {
+            out[4 * i] = (unsigned char) (state[i * lanes + l] >> 24);
+            out[4 * i + 1] = (unsigned char) (state[i * lanes + l] >> 16);
+            out[4 * i + 2] = (unsigned char) (state[i * lanes + l] >> 8);
+            out[4 * i + 3] = (unsigned char) state[i * lanes + l];
+         }
+
+         lane[l].job = SIZE_MAX;
+         active--;
+      }
+   }
+}
+
+static compress_fn_t
+get_compress (size_t lanes)
+{
+   switch (lanes) {
+   case 4:
+      return compress_sse2;
+   case 8:
+      return __builtin_cpu_supports ("avx2") ? compress_avx2 : NULL;
+   case 16:
+      return __builtin_cpu_supports ("avx512f") ? compress_avx512 : NULL;
+   default:
+      return NULL;
+   }
+}
+
+#endif /* KMS_SHA256_MB_X86 */
+
+bool
+kms_sha256_many_lanes (size_t lanes,
+                       size_t n,
+                       const char *const *inputs,
+                       const size_t *lens,
+                       unsigned char *hashes)
+{
+   size_t i;
+
+#ifdef KMS_SHA256_MB_X86
+   compress_fn_t compress = get_compress (lanes);
+
+   if (compress) {
+      hash_lanes (compress, lanes, n, inputs, lens, hashes);
+      return true;
+   }
+#endif
+
+   if (lanes != 1) {
+      return false;
+   }
+
+   for (i = 0; i < n; i++) {
+      if (!kms_sha256 (inputs[i], lens[i], hashes + 32 * i)) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+bool
+kms_sha256_many (size_t n,
+                 const char *const *inputs,
+                 const size_t *lens,
+                 unsigned char *hashes)
+{
+   size_t lanes = 1;
+
+#ifdef KMS_SHA256_MB_X86
+   /* fill as many lanes as there are inputs, the widest kernel is not worth
+    * it for a few */
+   if (n >= 16 && __builtin_cpu_supports ("avx512f")) {
+      lanes = 16;
+   } else if (n >= 8 && __builtin_cpu_supports ("avx2")) {
+      lanes = 8;
+   } else if (n >= 4) {
+      lanes = 4;
+   }
+#endif
+
+   return kms_sha256_many_lanes (lanes, n, inputs, lens, hashes);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The SHA-256 compression function over MB_LANES independent messages, one
+ * per 32-bit lane of MB_VEC. kms_sha256_mb.c includes this once per
+ * instruction set, after defining:
+ *
+ * MB_COMPRESS      name of the function to define
+ * MB_TARGET        function attributes, like __attribute__ ((target ("avx2")))
+ * MB_LANES         lanes per vector
+ * MB_VEC           vector type
+ * MB_LOAD(p)       load MB_LANES uint32_t from p, unaligned
+ * MB_STORE(p, v)   store to p, unaligned
+ * MB_SET1(x)       broadcast a uint32_t
+ * MB_ADD, MB_XOR, MB_AND, MB_OR
+ * MB_ANDNOT(a, b)  ~a & b
+ * MB_ROTR(v, n)    rotate each lane right by constant n
+ * MB_SHR(v, n)     shift each lane right by constant n
+ *
+ * "state" and "w" are row-major: row i holds word i of every lane. */
+
+#define MB_CH(e, f, g) MB_XOR (MB_AND (e, f), MB_ANDNOT (e, g))
+#define MB_MAJ(a, b, c) MB_OR (MB_AND (a, b), MB_AND (c, MB_OR (a, b)))
+#define MB_BSIG0(x) \
+   MB_XOR (MB_XOR (MB_ROTR (x, 2), MB_ROTR (x, 13)), MB_ROTR (x, 22))
+#define MB_BSIG1(x) \
+   MB_XOR (MB_XOR (MB_ROTR (x, 6), MB_ROTR (x, 11)), MB_ROTR (x, 25))
+#define MB_SSIG0(x) \
+   MB_XOR (MB_XOR (MB_ROTR (x, 7), MB_ROTR (x, 18)), MB_SHR (x, 3))
+#define MB_SSIG1(x) \
+   MB_XOR (MB_XOR (MB_ROTR (x, 17), MB_ROTR (x, 19)), MB_SHR (x, 10))
+
+static MB_TARGET void
+MB_COMPRESS (uint32_t *state, const uint32_t *w_in)
+{
+   MB_VEC a, b, c, d, e, f, g, h, t1, t2;
+   MB_VEC w[16];
+   int i;
+
+   for (i = 0; i < 16; i++) {
+      w[i] = MB_LOAD (w_in + i * MB_LANES);
+   }
+
+   a = MB_LOAD (state + 0 * MB_LANES);
+   b = MB_LOAD (state + 1 * MB_LANES);
+   c = MB_LOAD (state + 2 * MB_LANES);
+   d = MB_LOAD (state + 3 * MB_LANES);
+   e = MB_LOAD (state + 4 * MB_LANES);
+   f = MB_LOAD (state + 5 * MB_LANES);
+   g = MB_LOAD (state + 6 * MB_LANES);
+   h = MB_LOAD (state + 7 * MB_LANES);
+
+   for (i = 0; i < 64; i++) {
+      if (i >= 16) {
+         /* message schedule, in a ring of the last 16 words */
+         w[i & 15] = MB_ADD (MB_ADD (MB_SSIG1 (w[(i - 2) & 15]),
+                                     w[(i - 7) & 15]),
+                             MB_ADD (MB_SSIG0 (w[(i - 15) & 15]), w[i & 15]));
+      }
+
+      t1 = MB_ADD (MB_ADD (MB_ADD (h, MB_BSIG1 (e)), MB_CH (e, f, g)),
+                   MB_ADD (MB_SET1 (sha256_k[i]), w[i & 15]));
+      t2 = MB_ADD (MB_BSIG0 (a), MB_MAJ (a, b, c));
+      h = g;
+      g = f;
+      f = e;
+      e = MB_ADD (d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = MB_ADD (t1, t2);
+   }
+
+   MB_STORE (state + 0 * MB_LANES, MB_ADD (MB_LOAD (state + 0 * MB_LANES), a));
+   MB_STORE (state + 1 * MB_LANES, MB_ADD (MB_LOAD (state + 1 * MB_LANES), b));
+   MB_STORE (state + 2 * MB_LANES, MB_ADD (MB_LOAD (state + 2 * MB_LANES), c));
+   MB_STORE (state + 3 * MB_LANES, MB_ADD (MB_LOAD (state + 3 * MB_LANES), d));
+   MB_STORE (state + 4 * MB_LANES, MB_ADD (MB_LOAD (state + 4 * MB_LANES), e));
+   MB_STORE (state + 5 * MB_LANES, MB_ADD (MB_LOAD (state + 5 * MB_LANES), f));
+   MB_STORE (state + 6 * MB_LANES, MB_ADD (MB_LOAD (state + 6 * MB_LANES), g));
+   MB_STORE (state + 7 * MB_LANES, MB_ADD (MB_LOAD (state + 7 * MB_LANES), h));
+}
+
+#undef MB_CH
+#undef MB_MAJ
+#undef MB_BSIG0
+#undef MB_BSIG1
+#undef MB_SSIG0
+#undef MB_SSIG1
+
+#undef MB_COMPRESS
+#undef MB_TARGET
+#undef MB_LANES
+#undef MB_VEC
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_AND
+#undef MB_OR
+#undef MB_ANDNOT
+#undef MB_ROTR
+#undef MB_SHR
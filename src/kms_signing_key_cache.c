@@ -0,0 +1,330 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kms_signing_key_cache.h"
+#include "kms_alloc.h"
+#include "kms_crypto.h"
+#include "kms_message/kms_message.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+typedef SRWLOCK kms_mutex_t;
+#define KMS_MUTEX_INITIALIZER SRWLOCK_INIT
+#define kms_mutex_lock(_m) AcquireSRWLockExclusive (_m)
+#define kms_mutex_unlock(_m) ReleaseSRWLockExclusive (_m)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t kms_mutex_t;
+#define KMS_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define kms_mutex_lock(_m) pthread_mutex_lock (_m)
+#define kms_mutex_unlock(_m) pthread_mutex_unlock (_m)
+#endif
+
+/* 16 shards of 32 entries each, selected by the first byte of the id, so
+ * threads signing for different tenants rarely contend on the same lock. */
+#define KMS_SIGNING_KEY_CACHE_SHARDS 16
+#define KMS_SIGNING_KEY_CACHE_SHARD_SIZE 32
+#define KMS_DATE_LEN (sizeof "YYYYmmDD" - 1)
+
+typedef struct {
+   unsigned char id[KMS_SIGNING_KEY_CACHE_ID_LEN];
+   char date[KMS_DATE_LEN];
+   kms_signing_key_t *signing_key; /* NULL if the entry is unused */
+   uint64_t last_used;
+} kms_signing_key_entry_t;
+
+typedef struct {
+   kms_mutex_t lock;
+   uint64_t tick;
+   uint64_t hits;
+   uint64_t misses;
+   kms_signing_key_entry_t entries[KMS_SIGNING_KEY_CACHE_SHARD_SIZE];
+} kms_signing_key_shard_t;
+
+#define SHARD_INIT           \
+   {                         \
+      KMS_MUTEX_INITIALIZER  \
+   }
+#define SHARD_INIT4 SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT
+
+static kms_signing_key_shard_t shards[KMS_SIGNING_KEY_CACHE_SHARDS] = {
+   SHARD_INIT4, SHARD_INIT4, SHARD_INIT4, SHARD_INIT4};
+
+#undef SHARD_INIT4
+#undef SHARD_INIT
+
+static kms_signing_key_shard_t *
+get_shard (const unsigned char *id)
+{
+   return &shards[id[0] % KMS_SIGNING_KEY_CACHE_SHARDS];
+}
+
+/* typical tuples fit on the stack, longer ones are allocated */
+#define KMS_SIGNING_KEY_CACHE_TUPLE_STACK 256
+
+static char *
+put_field (char *p, const kms_request_str_t *field)
+{
+   /* length-prefix each field so ("ab", "c") and ("a", "bc") differ */
+   p += sprintf (p, "%zu:", field->len);
+   memcpy (p, field->str, field->len);
+
+   return p + field->len;
+}
+
+bool
+kms_signing_key_cache_id (kms_request_str_t *secret_key,
+                          kms_request_str_t *date,
+                          kms_request_str_t *region,
+                          kms_request_str_t *service,
+                          unsigned char *id)
+{
+   char stack_tuple[KMS_SIGNING_KEY_CACHE_TUPLE_STACK];
+   char *tuple = stack_tuple;
+   char *p;
+   size_t max_len;
+   bool r;
+
+   /* a length prefix and its colon take at most 21 bytes */
+   max_len = 4 * 21 + secret_key->len + date->len + region->len + service->len;
+   if (max_len > sizeof (stack_tuple)) {
+      tuple = kms_malloc (max_len);
+      if (!tuple) {
+         return false;
+      }
+   }
+
+   p = put_field (tuple, secret_key);
+   p = put_field (p, date);
+   p = put_field (p, region);
+   p = put_field (p, service);
+   r = kms_sha256 (tuple, (size_t) (p - tuple), id);
+   /* don't leave the secret behind */
+   memset (tuple, 0, (size_t) (p - tuple));
+   if (tuple != stack_tuple) {
+      kms_free (tuple);
+   }
+
+   return r;
+}
+
+static void
+signing_key_destroy (kms_signing_key_t *signing_key)
+{
+   kms_sha256_hmac_destroy (signing_key->hmac);
+   memset (signing_key, 0, sizeof (kms_signing_key_t));
+   kms_free (signing_key);
+}
+
+/* call with the shard locked. returns true if the last reference is gone and
+ * the caller must destroy the key after unlocking */
+static bool
+signing_key_unref (kms_signing_key_t *signing_key)
+{
+   return --signing_key->refs == 0;
+}
+
+static void
+entry_evict (kms_signing_key_entry_t *entry)
+{
+   if (entry->signing_key && signing_key_unref (entry->signing_key)) {
+      signing_key_destroy (entry->signing_key);
+   }
+
+   memset (entry, 0, sizeof (*entry));
+}
+
+static kms_signing_key_t *
+shard_find (kms_signing_key_shard_t *shard, const unsigned char *id)
+{
+   kms_signing_key_entry_t *entry;
+   size_t i;
+
+   for (i = 0; i < KMS_SIGNING_KEY_CACHE_SHARD_SIZE; i++) {
+      entry = &shard->entries[i];
+      if (entry->signing_key &&
+          0 == memcmp (entry->id, id, KMS_SIGNING_KEY_CACHE_ID_LEN)) {
+         entry->last_used = ++shard->tick;
+         entry->signing_key->refs++;
+         return entry->signing_key;
+      }
+   }
+
+   return NULL;
+}
+
+kms_signing_key_t *
+kms_signing_key_cache_get (const unsigned char *id)
+{
+   kms_signing_key_shard_t *shard = get_shard (id);
+   kms_signing_key_t *signing_key;
+
+   kms_mutex_lock (&shard->lock);
+   signing_key = shard_find (shard, id);
+   if (signing_key) {
+      shard->hits++;
+   } else {
+      shard->misses++;
+   }
+
+   kms_mutex_unlock (&shard->lock);
+
+   return signing_key;
+}
+
+kms_signing_key_t *
+kms_signing_key_cache_put (const unsigned char *id,
+                           kms_request_str_t *date,
+                           const unsigned char *key)
+{
+   kms_signing_key_shard_t *shard = get_shard (id);
+   kms_signing_key_entry_t *entry;
+   kms_signing_key_entry_t *victim = NULL;
+   kms_signing_key_t *signing_key;
+   kms_signing_key_t *existing;
+   size_t i;
+
+   signing_key = kms_calloc (1, sizeof (kms_signing_key_t));
+   if (!signing_key) {
+      return NULL;
+   }
+
+   memcpy (signing_key->key, key, sizeof (signing_key->key));
+   signing_key->hmac =
+      kms_sha256_hmac_new ((const char *) key, sizeof (signing_key->key));
+   if (!signing_key->hmac) {
+      signing_key_destroy (signing_key);
+      return NULL;
+   }
+
+   /* one reference for the caller */
+   signing_key->refs = 1;
+   signing_key->shard = shard;
+
+   if (date->len != KMS_DATE_LEN) {
+      /* not cacheable, but still usable by the caller */
+      return signing_key;
+   }
+
+   kms_mutex_lock (&shard->lock);
+   existing = shard_find (shard, id);
+   if (existing) {
+      /* another thread derived the same key first */
+      kms_mutex_unlock (&shard->lock);
+      signing_key_destroy (signing_key);
+      return existing;
+   }
+
+   for (i = 0; i < KMS_SIGNING_KEY_CACHE_SHARD_SIZE; i++) {
+      entry = &shard->entries[i];
+      /* keys derived for an earlier day are useless after the UTC date rolls
+       * over, evict them instead of waiting for them to age out */
+      if (entry->signing_key &&
+          memcmp (entry->date, date->str, KMS_DATE_LEN) < 0) {
+         entry_evict (entry);
+      }
+
+      if (victim && !victim->signing_key) {
+         /* already found a free slot */
+         continue;
+      }
+
+      if (!victim || !entry->signing_key ||
+          entry->last_used < victim->last_used) {
+         victim = entry;
+      }
+   }
+
+   entry_evict (victim);
+   memcpy (victim->id, id, KMS_SIGNING_KEY_CACHE_ID_LEN);
+   memcpy (victim->date, date->str, KMS_DATE_LEN);
+   /* and one for the cache */
+   signing_key->refs++;
+   victim->signing_key = signing_key;
+   victim->last_used = ++shard->tick;
+   kms_mutex_unlock (&shard->lock);
+
+   return signing_key;
+}
+
+void
+kms_signing_key_release (kms_signing_key_t *signing_key)
+{
+   kms_signing_key_shard_t *shard;
+   bool destroy;
+
+   if (!signing_key) {
+      return;
+   }
+
+   shard = (kms_signing_key_shard_t *) signing_key->shard;
+   kms_mutex_lock (&shard->lock);
+   destroy = signing_key_unref (signing_key);
+   kms_mutex_unlock (&shard->lock);
+
+   if (destroy) {
+      signing_key_destroy (signing_key);
+   }
+}
+
+void
+kms_signing_key_cache_clear (void)
+{
+   kms_signing_key_shard_t *shard;
+   size_t i, j;
+
+   for (i = 0; i < KMS_SIGNING_KEY_CACHE_SHARDS; i++) {
+      shard = &shards[i];
+      kms_mutex_lock (&shard->lock);
+      for (j = 0; j < KMS_SIGNING_KEY_CACHE_SHARD_SIZE; j++) {
+         entry_evict (&shard->entries[j]);
+      }
+
+      shard->tick = 0;
+      kms_mutex_unlock (&shard->lock);
+   }
+}
+
+void
+kms_request_get_signing_key_cache_stats (uint64_t *hits, uint64_t *misses)
+{
+   kms_signing_key_shard_t *shard;
+   uint64_t total_hits = 0;
+   uint64_t total_misses = 0;
+   size_t i;
+
+   for (i = 0; i < KMS_SIGNING_KEY_CACHE_SHARDS; i++) {
+      shard = &shards[i];
+      kms_mutex_lock (&shard->lock);
+      total_hits += shard->hits;
+      total_misses += shard->misses;
+      kms_mutex_unlock (&shard->lock);
+   }
+
+   if (hits) {
+      *hits = total_hits;
+   }
+
+   if (misses) {
+      *misses = total_misses;
+   }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KMS_SIGNING_KEY_CACHE_H
+#define KMS_SIGNING_KEY_CACHE_H
+
+#include "kms_crypto.h"
+#include "kms_request_str.h"
+
+#include <stdbool.h>
+
+/* A process-wide cache of derived SigV4 signing keys. Entries are identified
+ * by a SHA-256 over (secret, date, region, service), the secret itself is
+ * never stored. */
+
+#define KMS_SIGNING_KEY_CACHE_ID_LEN 32
+
+/* a derived signing key, shared by the cache and its callers */
+typedef struct _kms_signing_key_t {
+   unsigned char key[32];
+   kms_sha256_hmac_t *hmac; /* keyed with "key" */
+   int refs;
+   void *shard;
+} kms_signing_key_t;
+
+bool
+kms_signing_key_cache_id (kms_request_str_t *secret_key,
+                          kms_request_str_t *date,
+                          kms_request_str_t *region,
+                          kms_request_str_t *service,
+                          unsigned char *id);
+/* returns a new reference or NULL */
+kms_signing_key_t *
+kms_signing_key_cache_get (const unsigned char *id);
+/* returns a new reference or NULL */
+kms_signing_key_t *
+kms_signing_key_cache_put (const unsigned char *id,
+                           kms_request_str_t *date,
+                           const unsigned char *key);
+void
+kms_signing_key_release (kms_signing_key_t *signing_key);
+void
+kms_signing_key_cache_clear (void);
+
+#endif /* KMS_SIGNING_KEY_CACHE_H */
@@ -1,74 +1,75 @@
 /*
- * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright 2018-present MongoDB, Inc.
  *
- * Copyright (c) 1992, 1993
- *	The Regents of the University of California.  All rights reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
  *
- * This code is derived from software contributed to Berkeley by
- * Peter McIlroy.
+ *   http://www.apache.org/licenses/LICENSE-2.0
  *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
  */
 
-/**
- * This code is originally from:
- * https://github.com/freebsd/freebsd/blob/e7c6cef9514d3bb1f14a30a5ee871231523e43db/lib/libc/stdlib/merge.c
- */
+#include "sort.h"
 
 #include <stddef.h>
+#include <string.h>
 
-/*
- * This is to avoid out-of-bounds addresses in sorting the
- * last 4 elements.
- */
-
-typedef int (*cmp_t) (const void *, const void *);
 #define CMP(x, y) cmp (x, y)
-#define swap(a, b)   \
-   {                 \
-      s = b;         \
-      i = size;      \
-      do {           \
-         tmp = *a;   \
-         *a++ = *s;  \
-         *s++ = tmp; \
-      } while (--i); \
-      a -= size;     \
-   }
 
 void
-insertionsort (unsigned char *a, size_t n, size_t size, cmp_t cmp)
+mergesort_ptrs (const void **a, const void **scratch, size_t n, cmp_t cmp)
 {
-   unsigned char *ai, *s, *t, *u, tmp;
-   size_t i;
+   const void **src = a;
+   const void **dst = scratch;
+   const void **tmp;
+   const void *p;
+   size_t run, lo, mid, hi, i, j, k;
+
+   for (lo = 0; lo < n; lo += MERGESORT_RUN) {
+      hi = lo + MERGESORT_RUN < n ? lo + MERGESORT_RUN : n;
+      for (i = lo + 1; i < hi; i++) {
+         p = a[i];
+         for (j = i; j > lo && CMP (a[j - 1], p) > 0; j--) {
+            a[j] = a[j - 1];
+         }
+
+         a[j] = p;
+      }
+   }
+
+   /* bottom-up, merging back and forth between "a" and "scratch" */
+   for (run = MERGESORT_RUN; run < n; run *= 2) {
+      for (lo = 0; lo < n; lo += 2 * run) {
+         mid = lo + run < n ? lo + run : n;
+         hi = lo + 2 * run < n ? lo + 2 * run : n;
+         i = lo;
+         j = mid;
+         k = lo;
+         while (i < mid && j < hi) {
+            /* on ties take from the left, to keep it stable */
+            dst[k++] = CMP (src[j], src[i]) < 0 ? src[j++] : src[i++];
+         }
+
+         while (i < mid) {
+            dst[k++] = src[i++];
+         }
 
-   for (ai = a + size; --n >= 1; ai += size)
-      for (t = ai; t > a; t -= size) {
-         u = t - size;
-         if (CMP (u, t) <= 0)
-            break;
-         swap (u, t);
+         while (j < hi) {
+            dst[k++] = src[j++];
+         }
       }
+
+      tmp = src;
+      src = dst;
+      dst = tmp;
+   }
+
+   if (src != a) {
+      memcpy ((void *) a, (const void *) src, n * sizeof (void *));
+   }
 }
@@ -15,7 +15,14 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
+
 typedef int (*cmp_t) (const void *, const void *);
 
+/* runs this short are insertion sorted before merging */
+#define MERGESORT_RUN 8
+
+/* stable, O(n log n). sorts "n" pointers, "cmp" is called with the pointers
+ * themselves. "scratch" must have room for "n" pointers */
 void
-insertionsort (unsigned char *a, size_t n, size_t size, cmp_t cmp);
+mergesort_ptrs (const void **a, const void **scratch, size_t n, cmp_t cmp);
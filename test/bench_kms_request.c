@@ -0,0 +1,401 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Micro-benchmarks for internals, not run by the test suite. Build in
+ * release mode and run "bench_kms_request". */
+
+#include "src/kms_message/kms_message.h"
+#include "src/kms_message_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <src/kms_kv_list.h>
+#include <src/kms_request_str.h>
+#include <src/sort.h>
+
+/* aim for about this many comparisons per measurement */
+#define BENCH_WORK 20000000
+
+static double
+elapsed_ns (clock_t start, clock_t end, size_t iterations)
+{
+   return (double) (end - start) * 1e9 / CLOCKS_PER_SEC / (double) iterations;
+}
+
+static int
+cmp_kv_keys (const void *a, const void *b)
+{
+   return kms_kv_cmp_keys ((const kms_kv_t *) a, (const kms_kv_t *) b);
+}
+
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (c) 1992, 1993
+ *	The Regents of the University of California.  All rights reserved.
+ *
+ * This code is derived from software contributed to Berkeley by
+ * Peter McIlroy.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* the byte-swapping insertion sort that kms_kv_list_sort used to call, from
+ * FreeBSD's lib/libc/stdlib/merge.c, kept here as the baseline. it lived in
+ * another translation unit, called through "insertionsort_fn" the compiler
+ * can't specialize it for "cmp" here either */
+static void
+insertionsort_impl (unsigned char *a, size_t n, size_t size, cmp_t cmp)
+{
+   unsigned char *ai, *s, *t, *u, tmp;
+   size_t i;
+
+   for (ai = a + size; --n >= 1; ai += size) {
+      for (t = ai; t > a; t -= size) {
+         u = t - size;
+         if (cmp (u, t) <= 0) {
+            break;
+         }
+
+         /* swap u and t */
+         s = t;
+         i = size;
+         do {
+            tmp = *u;
+            *u++ = *s;
+            *s++ = tmp;
+         } while (--i);
+         u -= size;
+      }
+   }
+}
+
+static void (*volatile insertionsort_fn) (unsigned char *,
+                                          size_t,
+                                          size_t,
+                                          cmp_t) = insertionsort_impl;
+
+/* "n" headers with distinct names, in a shuffled order */
+static kms_kv_list_t *
+make_headers (size_t n)
+{
+   kms_kv_list_t *lst = kms_kv_list_new ();
+   kms_request_str_t *k = kms_request_str_new ();
+   kms_request_str_t *v = kms_request_str_new_from_chars ("value", -1);
+   size_t i;
+
+   for (i = 0; i < n; i++) {
+      k->len = 0;
+      kms_request_str_appendf (
+         k, "X-Header-%05u", (unsigned) ((i * 2654435761u) % 100003));
+      kms_kv_list_add (lst, k, v);
+   }
+
+   kms_request_str_destroy (k);
+   kms_request_str_destroy (v);
+
+   return lst;
+}
+
+/* kms_kv_list_sort against the insertion sort it replaced */
+static void
+bench_kv_list_sort (void)
+{
+   size_t sizes[] = {1, 8, 64, 512};
+   kms_kv_list_t *lst;
+   kms_kv_t *shuffled;
+   size_t i, j, n, iterations;
+   clock_t start;
+   double insertion_ns, merge_ns;
+
+   printf ("kms_kv_list_sort, ns per sort\n");
+   printf ("%8s %15s %15s\n", "entries", "insertionsort", "mergesort");
+
+   for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+      n = sizes[i];
+      iterations = BENCH_WORK / (n * n + 1) + 10;
+      lst = make_headers (n);
+      shuffled = malloc (n * sizeof (kms_kv_t));
+      memcpy (shuffled, lst->kvs, n * sizeof (kms_kv_t));
+
+      start = clock ();
+      for (j = 0; j < iterations; j++) {
+         memcpy (lst->kvs, shuffled, n * sizeof (kms_kv_t));
+         insertionsort_fn (
+            (unsigned char *) lst->kvs, n, sizeof (kms_kv_t), cmp_kv_keys);
+      }
+
+      insertion_ns = elapsed_ns (start, clock (), iterations);
+
+      start = clock ();
+      for (j = 0; j < iterations; j++) {
+         memcpy (lst->kvs, shuffled, n * sizeof (kms_kv_t));
+         kms_kv_list_sort (lst, cmp_kv_keys);
+      }
+
+      merge_ns = elapsed_ns (start, clock (), iterations);
+
+      printf ("%8u %15.0f %15.0f\n", (unsigned) n, insertion_ns, merge_ns);
+
+      /* the list owns the strings, put it back in the original order */
+      memcpy (lst->kvs, shuffled, n * sizeof (kms_kv_t));
+      free (shuffled);
+      kms_kv_list_destroy (lst);
+   }
+}
+
+static void *
+counting_malloc (size_t size, void *ctx)
+{
+   (*(size_t *) ctx)++;
+   return malloc (size);
+}
+
+static void *
+counting_realloc (void *ptr, size_t size, void *ctx)
+{
+   (*(size_t *) ctx)++;
+   return realloc (ptr, size);
+}
+
+static void
+counting_free (void *ptr, void *ctx)
+{
+   (void) ctx;
+   free (ptr);
+}
+
+/* a KMS request with a few headers, a query and a payload */
+static kms_request_t *
+build_request (kms_request_t *request)
+{
+   kms_request_set_region (request, "us-east-1");
+   kms_request_set_service (request, "kms");
+   kms_request_set_access_key_id (request, "AKIDEXAMPLE");
+   kms_request_set_secret_key (request,
+                               "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+   kms_request_add_header_field (
+      request, "Content-Type", "application/x-amz-json-1.1");
+   kms_request_add_header_field (
+      request, "X-Amz-Target", "TrentService.Encrypt");
+   kms_request_append_payload (request, "{\"KeyId\": \"alias/key\"}", 24);
+   kms_request_set_date_epoch (request, 1440938160);
+
+   return request;
+}
+
+static void
+print_count (const char *name, size_t count)
+{
+   printf ("%-28s %6u\n", name, (unsigned) count);
+}
+
+/* add an X-Amz-Content-Sha256 header to a list with room for it */
+static void
+add_content_sha256 (bool take)
+{
+   kms_kv_list_t *lst = kms_kv_list_new ();
+   kms_request_str_t *k;
+   kms_request_str_t *v;
+
+   k = kms_request_str_new_from_chars ("X-Amz-Content-Sha256", -1);
+   v = kms_request_str_new ();
+   kms_request_str_append_hex (
+      v, (const unsigned char *) "0123456789abcdef0123456789abcdef", 32);
+
+   if (take) {
+      kms_kv_list_add_take (lst, k, v);
+   } else {
+      kms_kv_list_add (lst, k, v);
+      kms_request_str_destroy (k);
+      kms_request_str_destroy (v);
+   }
+
+   kms_kv_list_destroy (lst);
+}
+
+/* calls to malloc and realloc per request, through the allocator hooks */
+static void
+bench_allocations (void)
+{
+   kms_message_allocator_t allocator;
+   kms_request_opt_t *opt;
+   kms_request_t *request;
+   kms_response_parser_t *parser;
+   const char *reply = "HTTP/1.1 200 OK\r\n"
+                       "x-amzn-RequestId: deeb35e5-4ecb-4bf1-9af5-84a5\r\n"
+                       "Content-Type: application/x-amz-json-1.1\r\n"
+                       "Content-Length: 2\r\n"
+                       "\r\n"
+                       "{}";
+   size_t allocs = 0;
+   size_t start;
+
+   kms_message_cleanup ();
+   allocator.malloc_fn = counting_malloc;
+   allocator.realloc_fn = counting_realloc;
+   allocator.free_fn = counting_free;
+   allocator.ctx = &allocs;
+   kms_message_set_allocator (&allocator);
+   kms_message_init ();
+
+   opt = kms_request_opt_new ();
+   kms_request_opt_set_connection_close (opt, true);
+
+   printf ("allocations per request\n");
+
+   /* warm the signing key cache */
+   request = build_request (kms_request_new ("POST", "/?a=1&b=2", opt));
+   kms_request_free_string (kms_request_get_signed (request));
+   kms_request_destroy (request);
+
+   start = allocs;
+   request = build_request (kms_request_new ("POST", "/?a=1&b=2", opt));
+   print_count ("build", allocs - start);
+   start = allocs;
+   kms_request_free_string (kms_request_get_signed (request));
+   print_count ("kms_request_get_signed", allocs - start);
+   start = allocs;
+   kms_request_free_string (kms_request_get_signed (request));
+   print_count ("  again", allocs - start);
+   /* finalize copies its headers into the entries the reset kept */
+   start = allocs;
+   kms_request_reset (request, "POST", "/?a=1&b=2", opt);
+   build_request (request);
+   kms_request_free_string (kms_request_get_signed (request));
+   print_count ("  reset, build and sign", allocs - start);
+   kms_request_destroy (request);
+
+   /* a header line the response parser has already copied out, adopted by
+    * its list, compared with copying it in */
+   start = allocs;
+   add_content_sha256 (false);
+   print_count ("header, kms_kv_list_add", allocs - start);
+   start = allocs;
+   add_content_sha256 (true);
+   print_count ("  kms_kv_list_add_take", allocs - start);
+
+   start = allocs;
+   parser = kms_response_parser_new ();
+   kms_response_parser_feed (
+      parser, (uint8_t *) reply, (uint32_t) strlen (reply));
+   kms_response_parser_destroy (parser);
+   print_count ("parse a response", allocs - start);
+
+   kms_request_opt_destroy (opt);
+   kms_message_cleanup ();
+   kms_message_set_allocator (NULL);
+   kms_message_init ();
+}
+
+/* kms_request_str_append_escaped on mostly unreserved and on UTF-8 input */
+static void
+bench_escape (void)
+{
+   const char *inputs[] = {"arn:aws:kms:us-east-1:111122223333:key/"
+                           "1234abcd-12ab-34cd-56ef-1234567890ab",
+                           "\xe1\x88\xb4\xe1\x88\xb4\xe1\x88\xb4 "
+                           "\xe1\x88\xb4\xe1\x88\xb4\xe1\x88\xb4 "
+                           "\xe1\x88\xb4\xe1\x88\xb4\xe1\x88\xb4"};
+   const char *names[] = {"key ARN", "utf-8"};
+   kms_request_str_t *in;
+   kms_request_str_t *out;
+   size_t i, j, iterations = 2000000;
+   clock_t start;
+
+   printf ("kms_request_str_append_escaped, ns per call\n");
+
+   for (i = 0; i < sizeof (inputs) / sizeof (inputs[0]); i++) {
+      in = kms_request_str_new_from_chars (inputs[i], -1);
+      out = kms_request_str_new ();
+      start = clock ();
+      for (j = 0; j < iterations; j++) {
+         out->len = 0;
+         kms_request_str_append_escaped (out, in, true);
+      }
+
+      printf ("%-28s %6.0f\n",
+              names[i],
+              elapsed_ns (start, clock (), iterations));
+      kms_request_str_destroy (in);
+      kms_request_str_destroy (out);
+   }
+}
+
+/* kms_request_str_append_hex of a SHA-256 hash */
+static void
+bench_hex (void)
+{
+   unsigned char hash[32];
+   kms_request_str_t *out = kms_request_str_new ();
+   size_t i, iterations = 5000000;
+   clock_t start;
+
+   for (i = 0; i < sizeof (hash); i++) {
+      hash[i] = (unsigned char) (i * 37);
+   }
+
+   start = clock ();
+   for (i = 0; i < iterations; i++) {
+      out->len = 0;
+      kms_request_str_append_hex (out, hash, sizeof (hash));
+   }
+
+   printf ("%-28s %6.0f\n",
+           "kms_request_str_append_hex",
+           elapsed_ns (start, clock (), iterations));
+   kms_request_str_destroy (out);
+}
+
+int
+main (int argc, char *argv[])
+{
+   (void) argc;
+   (void) argv;
+
+   kms_message_init ();
+   bench_kv_list_sort ();
+   bench_allocations ();
+   bench_escape ();
+   bench_hex ();
+   kms_message_cleanup ();
+
+   return 0;
+}